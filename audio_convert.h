@@ -0,0 +1,269 @@
+// audio_convert.h
+/*
+  FRT - A Godot platform targeting single board computers
+  Copyright (c) 2017-2025  Emanuele Fornara
+  SPDX-License-Identifier: MIT
+ */
+
+/*
+
+  SAMPLE CONVERSION:
+
+  Godot mixes int32 samples. Devices accepting int32 samples get them as they
+  are, float32 samples are a plain scale, while int16 samples are produced by
+  the kernels below. All the int16 kernels saturate and are expected to
+  give the same results, give or take one LSB when dithering.
+
+  Dithering adds a TPDF noise of +/- 1 LSB (the sum of the two 16-bit halves
+  of a xorshift32 value) before truncating. Both terms are halved before
+  adding them, so that the addition cannot overflow.
+
+  The vectorized kernels are only compiled when the target supports them
+  (i.e. SSE2 on x86_64, NEON on arm64 or arm32 with -mfpu=neon).
+
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#define FRT_AUDIO_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FRT_AUDIO_NEON
+#include <arm_neon.h>
+#endif
+
+namespace frt {
+
+typedef void (*ConvertS16Fn)(int16_t *dst, const int32_t *src, int n, uint32_t *dither);
+
+static inline uint32_t xorshift32(uint32_t x) {
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+static inline int32_t tpdf_noise(uint32_t r) {
+	return ((int32_t)r >> 16) + ((int32_t)(r << 16) >> 16);
+}
+
+static inline int16_t saturate_s16(int32_t v) {
+	return v < -32768 ? -32768 : (v > 32767 ? 32767 : v);
+}
+
+void convert_s16_scalar(int16_t *dst, const int32_t *src, int n, uint32_t *dither) {
+	if (!dither) {
+		// the upper 16 bits of an int32 always fit in an int16
+		for (int i = 0; i < n; i++)
+			dst[i] = src[i] >> 16;
+		return;
+	}
+	uint32_t r = dither[0];
+	for (int i = 0; i < n; i++) {
+		r = xorshift32(r);
+		dst[i] = saturate_s16(((src[i] >> 1) + (tpdf_noise(r) >> 1)) >> 15);
+	}
+	dither[0] = r;
+}
+
+#ifdef FRT_AUDIO_SSE2
+
+static inline __m128i xorshift32_sse2(__m128i x) {
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	return x;
+}
+
+static inline __m128i dither_s32_sse2(__m128i v, __m128i r) {
+	__m128i noise = _mm_add_epi32(_mm_srai_epi32(r, 16), _mm_srai_epi32(_mm_slli_epi32(r, 16), 16));
+	v = _mm_add_epi32(_mm_srai_epi32(v, 1), _mm_srai_epi32(noise, 1));
+	return _mm_srai_epi32(v, 15);
+}
+
+void convert_s16_sse2(int16_t *dst, const int32_t *src, int n, uint32_t *dither) {
+	int i = 0;
+	if (dither) {
+		__m128i r = _mm_loadu_si128((const __m128i *)dither);
+		for (; i + 8 <= n; i += 8) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+			__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 4));
+			r = xorshift32_sse2(r);
+			a = dither_s32_sse2(a, r);
+			r = xorshift32_sse2(r);
+			b = dither_s32_sse2(b, r);
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+		}
+		_mm_storeu_si128((__m128i *)dither, r);
+	} else {
+		for (; i + 8 <= n; i += 8) {
+			__m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + i)), 16);
+			__m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + i + 4)), 16);
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+		}
+	}
+	convert_s16_scalar(dst + i, src + i, n - i, dither);
+}
+
+#endif // FRT_AUDIO_SSE2
+
+#ifdef FRT_AUDIO_NEON
+
+static inline uint32x4_t xorshift32_neon(uint32x4_t x) {
+	x = veorq_u32(x, vshlq_n_u32(x, 13));
+	x = veorq_u32(x, vshrq_n_u32(x, 17));
+	x = veorq_u32(x, vshlq_n_u32(x, 5));
+	return x;
+}
+
+static inline int16x4_t dither_s16_neon(int32x4_t v, uint32x4_t r) {
+	int32x4_t ri = vreinterpretq_s32_u32(r);
+	int32x4_t noise = vaddq_s32(vshrq_n_s32(ri, 16), vshrq_n_s32(vshlq_n_s32(ri, 16), 16));
+	return vqshrn_n_s32(vhaddq_s32(v, noise), 15);
+}
+
+void convert_s16_neon(int16_t *dst, const int32_t *src, int n, uint32_t *dither) {
+	int i = 0;
+	if (dither) {
+		uint32x4_t r = vld1q_u32(dither);
+		for (; i + 8 <= n; i += 8) {
+			int32x4_t a = vld1q_s32(src + i);
+			int32x4_t b = vld1q_s32(src + i + 4);
+			r = xorshift32_neon(r);
+			int16x4_t lo = dither_s16_neon(a, r);
+			r = xorshift32_neon(r);
+			int16x4_t hi = dither_s16_neon(b, r);
+			vst1q_s16(dst + i, vcombine_s16(lo, hi));
+		}
+		vst1q_u32(dither, r);
+	} else {
+		for (; i + 8 <= n; i += 8) {
+			int16x4_t lo = vshrn_n_s32(vld1q_s32(src + i), 16);
+			int16x4_t hi = vshrn_n_s32(vld1q_s32(src + i + 4), 16);
+			vst1q_s16(dst + i, vcombine_s16(lo, hi));
+		}
+	}
+	convert_s16_scalar(dst + i, src + i, n - i, dither);
+}
+
+#endif // FRT_AUDIO_NEON
+
+void convert_f32(float *dst, const int32_t *src, int n) {
+	const float scale = 1.0f / 2147483648.0f;
+	for (int i = 0; i < n; i++)
+		dst[i] = src[i] * scale;
+}
+
+enum SampleFormat {
+	SF_S16,
+	SF_S32,
+	SF_F32
+};
+
+enum SampleKernel {
+	SK_Auto,
+	SK_Scalar,
+	SK_SSE2,
+	SK_NEON
+};
+
+/*
+  Devices can have more channels than the Godot mix (e.g. Godot 3.1 on a
+  5.1 device): the missing channels are filled with silence.
+ */
+class SampleConverter {
+private:
+	ConvertS16Fn convert_s16_;
+	uint32_t dither_[4];
+	bool use_dither_;
+	SampleFormat format_;
+	int in_channels_;
+	int out_channels_;
+	int sample_size_;
+	void convert_samples(void *dst, const int32_t *src, int n) {
+		switch (format_) {
+		case SF_S16:
+			convert_s16_((int16_t *)dst, src, n, use_dither_ ? dither_ : 0);
+			break;
+		case SF_S32:
+			memcpy(dst, src, n * sizeof(int32_t));
+			break;
+		case SF_F32:
+			convert_f32((float *)dst, src, n);
+			break;
+		}
+	}
+public:
+	SampleConverter() : convert_s16_(convert_s16_scalar), use_dither_(false) {
+		set_layout(SF_S16, 2, 2);
+		dither_[0] = 0x12345678;
+		dither_[1] = 0x9abcdef1;
+		dither_[2] = 0x2468ace1;
+		dither_[3] = 0x13579bdf;
+	}
+	// false if the kernel is not available in this build
+	bool init(SampleKernel kernel, bool dither) {
+		use_dither_ = dither;
+		switch (kernel) {
+		case SK_Auto:
+#if defined(FRT_AUDIO_NEON)
+			convert_s16_ = convert_s16_neon;
+#elif defined(FRT_AUDIO_SSE2)
+			convert_s16_ = convert_s16_sse2;
+#else
+			convert_s16_ = convert_s16_scalar;
+#endif
+			return true;
+		case SK_Scalar:
+			convert_s16_ = convert_s16_scalar;
+			return true;
+#ifdef FRT_AUDIO_SSE2
+		case SK_SSE2:
+			convert_s16_ = convert_s16_sse2;
+			return true;
+#endif
+#ifdef FRT_AUDIO_NEON
+		case SK_NEON:
+			convert_s16_ = convert_s16_neon;
+			return true;
+#endif
+		default:
+			convert_s16_ = convert_s16_scalar;
+			return false;
+		}
+	}
+	void set_layout(SampleFormat format, int in_channels, int out_channels) {
+		format_ = format;
+		in_channels_ = in_channels;
+		out_channels_ = out_channels;
+		sample_size_ = format == SF_S16 ? sizeof(int16_t) : sizeof(int32_t);
+	}
+	int get_frame_size() const {
+		return out_channels_ * sample_size_;
+	}
+	// true if the int32 frames can be queued as they are
+	bool is_passthrough() const {
+		return format_ == SF_S32 && in_channels_ == out_channels_;
+	}
+	void convert(void *dst, const int32_t *src, int n_of_frames) {
+		if (in_channels_ == out_channels_) {
+			convert_samples(dst, src, n_of_frames * in_channels_);
+			return;
+		}
+		uint8_t *p = (uint8_t *)dst;
+		const int in_size = in_channels_ * sample_size_;
+		const int pad_size = (out_channels_ - in_channels_) * sample_size_;
+		for (int i = 0; i < n_of_frames; i++) {
+			convert_samples(p, src, in_channels_);
+			memset(p + in_size, 0, pad_size);
+			p += in_size + pad_size;
+			src += in_channels_;
+		}
+	}
+};
+
+} // namespace frt
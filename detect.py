@@ -28,6 +28,7 @@ def get_opts():
 		('triple', 'Cross-compilation triple (e.g. arm-linux-gnueabihf) or none', 'none'),
 		BoolVariable('use_llvm', 'Use llvm compiler', False),
 		BoolVariable('use_static_cpp', 'Link libgcc and libstdc++ statically', False),
+		BoolVariable('dl_profile', 'Count calls and time spent in GL functions', False),
 	]
 
 def get_flags():
@@ -72,6 +73,9 @@ def configure_misc(env):
 	env.Append(LIBS=['pthread', 'z', 'dl'])
 	if env['use_static_cpp']:
 		env.Append(LINKFLAGS=['-static-libgcc', '-static-libstdc++'])
+	if env['dl_profile']:
+		env.Append(CPPFLAGS=['-DFRT_DL_PROFILE'])
+		env.extra_suffix += '.dlprof'
 	env['ENV']['PATH'] = os.getenv('PATH')
 	env['ENV']['LD_LIBRARY_PATH'] = os.getenv('LD_LIBRARY_PATH')
 
@@ -9,12 +9,21 @@
 
 import re
 
+# Symbols marked with a trailing "// optional" comment (e.g. extensions)
+# are not reported when missing.
+#
+# When FRT_DL_PROFILE is defined, calls go through generated wrappers that
+# count them and accumulate the time spent in each function. The totals
+# are printed to stderr at exit.
+
 def parse_dl(dl, suffix):
 	libname = 'unnamed'
 	head = ''
 	symbols = []
 	types = []
 	includes = []
+	optionals = []
+	protos = []
 	f_dl = open(dl, 'r')
 	for line in f_dl.readlines():
 		line = line.replace('\n', '')
@@ -35,12 +44,26 @@ def parse_dl(dl, suffix):
 		s = m.group(1)
 		symbols.append(s)
 		ls = libname + '_' + s
+		optional = re.search(r'\s*//\s*optional\s*$', line)
+		optionals.append(optional is not None)
+		if optional:
+			line = line[:optional.start()]
 		types.append(line.replace('___' + s + '___', 'FRT_FN_' + ls))
+		m = re.search(r'^typedef\s+(.*?)\s*\(\*___.*___\)\((.*)\);$', line)
+		protos.append((m.group(1), m.group(2)))
 	f_dl.close()
-	return (libname, head, symbols, types, includes)
+	return (libname, head, symbols, types, includes, optionals, protos)
+
+def parse_args(params):
+	args = []
+	for p in params.split(','):
+		m = re.search(r'(\w+)\s*$', p)
+		if m and p.strip() != 'void':
+			args.append(m.group(1))
+	return ', '.join(args)
 
 def build_h(dl, h):
-	libname, head, symbols, types, includes = parse_dl(dl, '.gen.h')
+	libname, head, symbols, types, includes, optionals, protos = parse_dl(dl, '.gen.h')
 	f = open(h, 'w')
 	f.write(head)
 	def out(s=None):
@@ -54,9 +77,19 @@ def build_h(dl, h):
 	for s in types:
 		out(s)
 	out()
+	out('#ifdef FRT_DL_PROFILE')
+	for s, (ret, params) in zip(symbols, protos):
+		ls = libname + '_' + s
+		out('extern ' + ret + ' frt_prof_' + ls + '(' + params + ');')
+	out()
+	for s in symbols:
+		ls = libname + '_' + s
+		out('#define ' + s + ' frt_prof_' + ls)
+	out('#else')
 	for s in symbols:
 		ls = libname + '_' + s
 		out('#define ' + s + ' frt_fn_' + ls)
+	out('#endif')
 	out()
 	for s in symbols:
 		ls = libname + '_' + s
@@ -68,18 +101,32 @@ def build_h(dl, h):
 	f.close()
 
 def build_cc(dl, cc):
-	libname, head, symbols, types, includes = parse_dl(dl, '.gen.cc')
+	libname, head, symbols, types, includes, optionals, protos = parse_dl(dl, '.gen.cc')
 	f = open(cc, 'w')
 	f.write(head)
 	assignments = ''
 	for s in symbols:
 		ls = libname + '_' + s
 		assignments += 'FRT_FN_' + ls + ' frt_fn_' + ls + ' = 0;\n'
-	resolutions = ''
-	for s in symbols:
+	table = ''
+	for s, optional in zip(symbols, optionals):
 		ls = libname + '_' + s
-		resolutions += '\tfrt_fn_' + ls + ' = (FRT_FN_' + ls + ')'
-		resolutions += 'get_proc_address("' + s + '");\n'
+		table += '\t{ "' + s + '", (void **)&frt_fn_' + ls + ', '
+		table += ('true' if optional else 'false') + ' },\n'
+	wrappers = ''
+	for i, (s, (ret, params)) in enumerate(zip(symbols, protos)):
+		ls = libname + '_' + s
+		call = 'frt_fn_' + ls + '(' + parse_args(params) + ')'
+		wrappers += ret + ' frt_prof_' + ls + '(' + params + ') {\n'
+		wrappers += '\tuint64_t t0 = prof_now();\n'
+		if ret == 'void':
+			wrappers += '\t' + call + ';\n'
+			wrappers += '\tprof_add(%d, t0);\n' % i
+		else:
+			wrappers += '\t' + ret + ' res = ' + call + ';\n'
+			wrappers += '\tprof_add(%d, t0);\n' % i
+			wrappers += '\treturn res;\n'
+		wrappers += '}\n\n'
 	f.write("""\
 #include "%(libname)s.gen.h"
 
@@ -87,13 +134,69 @@ def build_cc(dl, cc):
 
 %(assignments)s
 
+static const struct {
+	const char *name;
+	void **slot;
+	bool optional;
+} symbols[] = {
+%(table)s
+	{ 0, 0, false }
+};
+
+#ifdef FRT_DL_PROFILE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+static struct {
+	uint64_t calls;
+	uint64_t ns;
+} prof[sizeof(symbols) / sizeof(symbols[0])];
+
+static inline uint64_t prof_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void prof_add(int i, uint64_t t0) {
+	prof[i].calls++;
+	prof[i].ns += prof_now() - t0;
+}
+
+static void prof_dump() {
+	fprintf(stderr, "frt: %(libname)s profile (calls, total us, avg ns):\\n");
+	for (int i = 0; symbols[i].name; i++)
+		if (prof[i].calls)
+			fprintf(stderr, "%%s %%llu %%llu %%llu\\n", symbols[i].name,
+					(unsigned long long)prof[i].calls,
+					(unsigned long long)(prof[i].ns / 1000),
+					(unsigned long long)(prof[i].ns / prof[i].calls));
+}
+
+%(wrappers)s
+#endif
+
 void frt_resolve_symbols_%(libname)s(FRT_FN_%(libname)s_GetProcAddress get_proc_address) {
-%(resolutions)s
+	int missing = 0;
+	for (int i = 0; symbols[i].name; i++) {
+		*symbols[i].slot = get_proc_address(symbols[i].name);
+		if (*symbols[i].slot || symbols[i].optional)
+			continue;
+		fprintf(stderr, missing++ ? " %%s" : "frt: %(libname)s: missing symbols: %%s", symbols[i].name);
+	}
+	if (missing)
+		fprintf(stderr, "\\n");
+#ifdef FRT_DL_PROFILE
+	atexit(prof_dump);
+#endif
 }
 """ % {
 		'libname': libname,
 		'assignments': assignments[:-1],
-		'resolutions': resolutions[:-1]
+		'table': table[:-1],
+		'wrappers': wrappers[:-1]
 	})
 	f.close()
 
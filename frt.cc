@@ -51,6 +51,8 @@ static void usage(const char *program_name, int code) {
 		"  -v                  show version and exit\n"
 		"  -l                  show license and exit\n"
 		"  -h                  show this page and exit\n"
+		"  -t file             record frame timings to file (.csv or .json)\n"
+		"  -s scale            render at scale (0.1 to 1) of the window size\n"
 	"\n", program_name);
 	exit(code);
 }
@@ -67,6 +69,10 @@ extern "C" void frt_parse_frt_args(int argc, char *argv[]) {
 			exit(0);
 		} else if (!strcmp(s, "-h")) {
 			usage(program_name, 0);
+		} else if (!strcmp(s, "-t") && i + 1 < argc) {
+			setenv("FRT_TRACE", argv[++i], 1);
+		} else if (!strcmp(s, "-s") && i + 1 < argc) {
+			setenv("FRT_RENDER_SCALE", argv[++i], 1);
 		} else {
 			usage(program_name, 1);
 		}
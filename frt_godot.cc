@@ -13,6 +13,8 @@
 #include "drivers/gles2/rasterizer_gles2.h"
 
 #include "core/print_string.h"
+#include "core/class_db.h"
+#include "core/engine.h"
 #include "drivers/unix/os_unix.h"
 #pragma GCC diagnostic ignored "-Wvolatile"
 #include "servers/audio_server.h"
@@ -22,18 +24,33 @@
 #include "servers/visual/rasterizer.h"
 #include "servers/visual/visual_server_raster.h"
 #include "main/main.h"
+#include "scene/main/scene_tree.h"
+#include "scene/main/viewport.h"
 
 namespace frt {
 
-static const char *default_audio_device = "default"; // TODO
+static const char *default_audio_device = "Default";
 
 class AudioDriverSDL2 : public AudioDriver, public SampleProducer {
 private:
 	Audio audio_;
 	int mix_rate_;
 	SpeakerMode speaker_mode_;
+	String device_;
+	String capture_device_;
+	Array get_devices(bool capture) {
+		Array list;
+		list.push_back(default_audio_device);
+		const int n = Audio::get_device_count(capture);
+		for (int i = 0; i < n; i++) {
+			const char *name = Audio::get_device_name(i, capture);
+			if (name)
+				list.push_back(String::utf8(name));
+		}
+		return list;
+	}
 public:
-	AudioDriverSDL2() : audio_(this) {
+	AudioDriverSDL2() : audio_(this), device_(default_audio_device), capture_device_(default_audio_device) {
 	}
 public: // AudioDriverSW
 	const char *get_name() const override {
@@ -41,10 +58,12 @@ public: // AudioDriverSW
 	}
 	Error init() override {
 		mix_rate_ = GLOBAL_GET("audio/mix_rate");
-		speaker_mode_ = SPEAKER_MODE_STEREO;
 		const int latency = GLOBAL_GET("audio/output_latency");
 		const int samples = closest_power_of_2(latency * mix_rate_ / 1000);
-		return audio_.init(mix_rate_, samples) ? OK : ERR_CANT_OPEN;
+		if (!audio_.init(mix_rate_, samples))
+			return ERR_CANT_OPEN;
+		speaker_mode_ = get_speaker_mode_by_total_channels(audio_.get_channels());
+		return OK;
 	}
 	int get_mix_rate() const override {
 		return mix_rate_;
@@ -52,15 +71,23 @@ public: // AudioDriverSW
 	SpeakerMode get_speaker_mode() const override {
 		return speaker_mode_;
 	}
+	float get_latency() override {
+		return audio_.get_output_latency();
+	}
 	Array get_device_list() override {
-		Array list;
-		list.push_back(default_audio_device);
-		return list;
+		return get_devices(false);
 	}
 	String get_device() override {
-		return default_audio_device;
+		return device_;
 	}
 	void set_device(String device) override {
+		if (device == device_)
+			return;
+		device_ = device;
+		if (device == default_audio_device)
+			audio_.set_device(0);
+		else
+			audio_.set_device(device.utf8().get_data());
 	}
 	void start() override {
 		audio_.start();
@@ -74,10 +101,555 @@ public: // AudioDriverSW
 	void finish() override {
 		audio_.finish();
 	}
+	Error capture_start() override {
+		lock();
+		input_buffer_init(audio_.get_capture_period());
+		unlock();
+		audio_.start_capture();
+		return OK;
+	}
+	Error capture_stop() override {
+		audio_.stop_capture();
+		return OK;
+	}
+	Array capture_get_device_list() override {
+		return get_devices(true);
+	}
+	String capture_get_device() override {
+		return capture_device_;
+	}
+	void capture_set_device(const String &device) override {
+		capture_device_ = device;
+		if (device == default_audio_device)
+			audio_.set_capture_device(0);
+		else
+			audio_.set_capture_device(device.utf8().get_data());
+	}
+	Audio *get_audio() {
+		return &audio_;
+	}
 public: // SampleProducer
 	void produce_samples(int n_of_frames, int32_t *frames) override {
 		audio_server_process(n_of_frames, frames);
 	}
+	void consume_samples(int n_of_frames, const int32_t *frames) override {
+		const int n_of_samples = n_of_frames * 2;
+		for (int i = 0; i < n_of_samples; i++)
+			input_buffer_write(frames[i]);
+	}
+};
+
+class Godot3_OS;
+
+// rumble requests are pushed to OS_FRT instead of being polled every frame
+class InputFRT : public InputDefault {
+private:
+	OS_FRT *os_;
+public:
+	InputFRT(OS_FRT *os) : os_(os) {
+	}
+	void start_joy_vibration(int p_device, float p_weak_magnitude, float p_strong_magnitude, float p_duration) override {
+		InputDefault::start_joy_vibration(p_device, p_weak_magnitude, p_strong_magnitude, p_duration);
+		os_->request_js_vibra(p_device);
+	}
+	void stop_joy_vibration(int p_device) override {
+		InputDefault::stop_joy_vibration(p_device);
+		os_->request_js_vibra(p_device);
+	}
+};
+
+/*
+  Input events are recycled once Godot (and the game) are done with them,
+  i.e. when the pool holds the only reference. Only the properties set by
+  the handlers are reset, so they must set all the ones they use.
+ */
+template <typename T>
+class EventPool {
+private:
+	static const int SIZE = 16;
+	Ref<T> events_[SIZE];
+	int next_;
+	int *allocations_;
+public:
+	EventPool(int *allocations) : next_(0), allocations_(allocations) {
+	}
+	Ref<T> get() {
+		for (int i = 0; i < SIZE; i++) {
+			Ref<T> &ev = events_[next_];
+			next_ = (next_ + 1) % SIZE;
+			if (ev.is_valid() && ev->reference_get_count() == 1)
+				return ev;
+		}
+		Ref<T> &ev = events_[next_];
+		next_ = (next_ + 1) % SIZE;
+		ev.instance();
+		(*allocations_)++;
+		return ev;
+	}
+	void clear() {
+		for (int i = 0; i < SIZE; i++)
+			events_[i].unref();
+	}
+};
+
+/*
+  Render scale (FRT_RENDER_SCALE, or --frt -s scale).
+
+  Godot renders at a fraction of the drawable size into an offscreen
+  framebuffer, set as the rasterizer system_fbo, which is then stretched to
+  the window by a single draw call before swapping buffers, using
+  FRT_RENDER_FILTER: nearest, bilinear or sharp (nearest up to the largest
+  integer scale, bilinear for the rest). Godot direct to screen rendering
+  (GLES2) is not supported, as the framebuffer has no depth buffer: if the
+  root viewport uses it once the main loop is initialized, scaling is
+  turned off, with a warning, and later scale changes are ignored.
+
+  The GPU time of each frame (swap to swap) is measured, with or without
+  scaling, if EXT_disjoint_timer_query is available.
+
+  GLES2 is enough here, and the symbols of the other Godot driver are not
+  resolved, so functions have their own table. All methods but the setters
+  must be called from the thread owning the context.
+ */
+class Upscaler {
+private:
+	struct {
+		void (*ActiveTexture)(GLenum texture);
+		void (*AttachShader)(GLuint program, GLuint shader);
+		void (*BindAttribLocation)(GLuint program, GLuint index, const GLchar *name);
+		void (*BindBuffer)(GLenum target, GLuint buffer);
+		void (*BindFramebuffer)(GLenum target, GLuint framebuffer);
+		void (*BindTexture)(GLenum target, GLuint texture);
+		void (*BufferData)(GLenum target, GLsizeiptr size, const void *data, GLenum usage);
+		GLenum (*CheckFramebufferStatus)(GLenum target);
+		void (*CompileShader)(GLuint shader);
+		GLuint (*CreateProgram)();
+		GLuint (*CreateShader)(GLenum type);
+		void (*DeleteShader)(GLuint shader);
+		void (*Disable)(GLenum cap);
+		void (*DisableVertexAttribArray)(GLuint index);
+		void (*DrawArrays)(GLenum mode, GLint first, GLsizei count);
+		void (*Enable)(GLenum cap);
+		void (*EnableVertexAttribArray)(GLuint index);
+		void (*FramebufferTexture2D)(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
+		void (*GenBuffers)(GLsizei n, GLuint *buffers);
+		void (*GenFramebuffers)(GLsizei n, GLuint *framebuffers);
+		void (*GenTextures)(GLsizei n, GLuint *textures);
+		void (*GetIntegerv)(GLenum pname, GLint *data);
+		void (*GetProgramiv)(GLuint program, GLenum pname, GLint *params);
+		void (*GetShaderiv)(GLuint shader, GLenum pname, GLint *params);
+		GLint (*GetUniformLocation)(GLuint program, const GLchar *name);
+		void (*GetVertexAttribiv)(GLuint index, GLenum pname, GLint *params);
+		GLboolean (*IsEnabled)(GLenum cap);
+		void (*LinkProgram)(GLuint program);
+		void (*ShaderSource)(GLuint shader, GLsizei count, const GLchar *const *string, const GLint *length);
+		void (*TexImage2D)(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const void *pixels);
+		void (*TexParameteri)(GLenum target, GLenum pname, GLint param);
+		void (*Uniform1i)(GLint location, GLint v0);
+		void (*Uniform2f)(GLint location, GLfloat v0, GLfloat v1);
+		void (*UseProgram)(GLuint program);
+		void (*VertexAttribPointer)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void *pointer);
+		void (*Viewport)(GLint x, GLint y, GLsizei width, GLsizei height);
+		// optional
+		void (*BindVertexArray)(GLuint array);
+		void (*GenQueriesEXT)(GLsizei n, GLuint *ids);
+		void (*BeginQueryEXT)(GLenum target, GLuint id);
+		void (*EndQueryEXT)(GLenum target);
+		void (*GetQueryObjectuivEXT)(GLuint id, GLenum pname, GLuint *params);
+		void (*GetQueryObjectui64vEXT)(GLuint id, GLenum pname, GLuint64 *params);
+	} gl_;
+	enum {
+		TIME_ELAPSED_EXT = 0x88bf,
+		QUERY_RESULT_EXT = 0x8866,
+		QUERY_RESULT_AVAILABLE_EXT = 0x8867,
+		GPU_DISJOINT_EXT = 0x8fbb
+	};
+	bool resolve_gl() {
+		const struct {
+			const char *name;
+			void **slot;
+			bool optional;
+		} symbols[] = {
+			{ "glActiveTexture", (void **)&gl_.ActiveTexture, false },
+			{ "glAttachShader", (void **)&gl_.AttachShader, false },
+			{ "glBindAttribLocation", (void **)&gl_.BindAttribLocation, false },
+			{ "glBindBuffer", (void **)&gl_.BindBuffer, false },
+			{ "glBindFramebuffer", (void **)&gl_.BindFramebuffer, false },
+			{ "glBindTexture", (void **)&gl_.BindTexture, false },
+			{ "glBufferData", (void **)&gl_.BufferData, false },
+			{ "glCheckFramebufferStatus", (void **)&gl_.CheckFramebufferStatus, false },
+			{ "glCompileShader", (void **)&gl_.CompileShader, false },
+			{ "glCreateProgram", (void **)&gl_.CreateProgram, false },
+			{ "glCreateShader", (void **)&gl_.CreateShader, false },
+			{ "glDeleteShader", (void **)&gl_.DeleteShader, false },
+			{ "glDisable", (void **)&gl_.Disable, false },
+			{ "glDisableVertexAttribArray", (void **)&gl_.DisableVertexAttribArray, false },
+			{ "glDrawArrays", (void **)&gl_.DrawArrays, false },
+			{ "glEnable", (void **)&gl_.Enable, false },
+			{ "glEnableVertexAttribArray", (void **)&gl_.EnableVertexAttribArray, false },
+			{ "glFramebufferTexture2D", (void **)&gl_.FramebufferTexture2D, false },
+			{ "glGenBuffers", (void **)&gl_.GenBuffers, false },
+			{ "glGenFramebuffers", (void **)&gl_.GenFramebuffers, false },
+			{ "glGenTextures", (void **)&gl_.GenTextures, false },
+			{ "glGetIntegerv", (void **)&gl_.GetIntegerv, false },
+			{ "glGetProgramiv", (void **)&gl_.GetProgramiv, false },
+			{ "glGetShaderiv", (void **)&gl_.GetShaderiv, false },
+			{ "glGetUniformLocation", (void **)&gl_.GetUniformLocation, false },
+			{ "glGetVertexAttribiv", (void **)&gl_.GetVertexAttribiv, false },
+			{ "glIsEnabled", (void **)&gl_.IsEnabled, false },
+			{ "glLinkProgram", (void **)&gl_.LinkProgram, false },
+			{ "glShaderSource", (void **)&gl_.ShaderSource, false },
+			{ "glTexImage2D", (void **)&gl_.TexImage2D, false },
+			{ "glTexParameteri", (void **)&gl_.TexParameteri, false },
+			{ "glUniform1i", (void **)&gl_.Uniform1i, false },
+			{ "glUniform2f", (void **)&gl_.Uniform2f, false },
+			{ "glUseProgram", (void **)&gl_.UseProgram, false },
+			{ "glVertexAttribPointer", (void **)&gl_.VertexAttribPointer, false },
+			{ "glViewport", (void **)&gl_.Viewport, false },
+			{ "glBindVertexArray", (void **)&gl_.BindVertexArray, true },
+			{ "glGenQueriesEXT", (void **)&gl_.GenQueriesEXT, true },
+			{ "glBeginQueryEXT", (void **)&gl_.BeginQueryEXT, true },
+			{ "glEndQueryEXT", (void **)&gl_.EndQueryEXT, true },
+			{ "glGetQueryObjectuivEXT", (void **)&gl_.GetQueryObjectuivEXT, true },
+			{ "glGetQueryObjectui64vEXT", (void **)&gl_.GetQueryObjectui64vEXT, true },
+			{ 0, 0, false }
+		};
+		bool ok = true;
+		for (int i = 0; symbols[i].name; i++) {
+			*symbols[i].slot = SDL_GL_GetProcAddress(symbols[i].name);
+			if (!*symbols[i].slot && !symbols[i].optional) {
+				warn("upscaler: missing symbol: %s", symbols[i].name);
+				ok = false;
+			}
+		}
+		return ok;
+	}
+	static const int N_OF_QUERIES = 4;
+	bool timer_;
+	GLuint queries_[N_OF_QUERIES];
+	int next_query_;
+	int n_pending_queries_;
+	bool query_active_;
+	mutable SDL_atomic_t gpu_time_usec_; // -1: not available
+	void init_timer() {
+		timer_ = SDL_GL_ExtensionSupported("GL_EXT_disjoint_timer_query") && gl_.GenQueriesEXT && gl_.BeginQueryEXT && gl_.EndQueryEXT && gl_.GetQueryObjectuivEXT && gl_.GetQueryObjectui64vEXT;
+		if (timer_)
+			gl_.GenQueriesEXT(N_OF_QUERIES, queries_);
+	}
+	// results are a few frames late, to avoid stalling the pipeline
+	void collect_queries() {
+		GLuint64 ns = 0;
+		bool found = false;
+		while (n_pending_queries_) {
+			const GLuint query = queries_[(next_query_ + N_OF_QUERIES - n_pending_queries_) % N_OF_QUERIES];
+			GLuint available = 0;
+			gl_.GetQueryObjectuivEXT(query, QUERY_RESULT_AVAILABLE_EXT, &available);
+			if (!available)
+				break;
+			gl_.GetQueryObjectui64vEXT(query, QUERY_RESULT_EXT, &ns);
+			n_pending_queries_--;
+			found = true;
+		}
+		GLint disjoint = 0;
+		gl_.GetIntegerv(GPU_DISJOINT_EXT, &disjoint);
+		if (found && !disjoint)
+			SDL_AtomicSet(&gpu_time_usec_, (int)(ns / 1000));
+	}
+	void begin_query() {
+		collect_queries();
+		if (n_pending_queries_ == N_OF_QUERIES)
+			return;
+		gl_.BeginQueryEXT(TIME_ELAPSED_EXT, queries_[next_query_]);
+		query_active_ = true;
+	}
+	void end_query() {
+		if (!query_active_)
+			return;
+		gl_.EndQueryEXT(TIME_ELAPSED_EXT);
+		next_query_ = (next_query_ + 1) % N_OF_QUERIES;
+		n_pending_queries_++;
+		query_active_ = false;
+	}
+	GLuint compile_shader(GLenum type, const char *source) {
+		const GLuint shader = gl_.CreateShader(type);
+		gl_.ShaderSource(shader, 1, &source, 0);
+		gl_.CompileShader(shader);
+		GLint status = 0;
+		gl_.GetShaderiv(shader, GL_COMPILE_STATUS, &status);
+		if (!status) {
+			warn("upscaler: shader compilation failed");
+			gl_.DeleteShader(shader);
+			return 0;
+		}
+		return shader;
+	}
+	bool init_program() {
+		static const char *vertex_source =
+			"attribute vec2 pos;\n"
+			"varying vec2 uv;\n"
+			"void main() {\n"
+			"	uv = pos * 0.5 + 0.5;\n"
+			"	gl_Position = vec4(pos, 0.0, 1.0);\n"
+			"}\n";
+		static const char *fragment_source =
+			"#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+			"precision highp float;\n"
+			"#else\n"
+			"precision mediump float;\n"
+			"#endif\n"
+			"uniform sampler2D tex;\n"
+			"uniform vec2 size;\n"
+			"uniform vec2 prescale;\n"
+			"varying vec2 uv;\n"
+			"void main() {\n"
+			"	vec2 texel = uv * size;\n"
+			"	vec2 range = 0.5 - 0.5 / prescale;\n"
+			"	vec2 dist = fract(texel) - 0.5;\n"
+			"	vec2 f = (dist - clamp(dist, -range, range)) * prescale + 0.5;\n"
+			"	gl_FragColor = texture2D(tex, (floor(texel) + f) / size);\n"
+			"}\n";
+		const GLuint vertex = compile_shader(GL_VERTEX_SHADER, vertex_source);
+		const GLuint fragment = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+		if (!vertex || !fragment)
+			return false;
+		program_ = gl_.CreateProgram();
+		gl_.AttachShader(program_, vertex);
+		gl_.AttachShader(program_, fragment);
+		gl_.BindAttribLocation(program_, 0, "pos");
+		gl_.LinkProgram(program_);
+		gl_.DeleteShader(vertex);
+		gl_.DeleteShader(fragment);
+		GLint status = 0;
+		gl_.GetProgramiv(program_, GL_LINK_STATUS, &status);
+		if (!status) {
+			warn("upscaler: program link failed");
+			return false;
+		}
+		tex_location_ = gl_.GetUniformLocation(program_, "tex");
+		size_location_ = gl_.GetUniformLocation(program_, "size");
+		prescale_location_ = gl_.GetUniformLocation(program_, "prescale");
+		return true;
+	}
+	UpscaleFilter filter_;
+	float scale_;
+	SDL_atomic_t render_size_; // packed, see pack()
+	SDL_atomic_t output_size_;
+	bool initialized_;
+	mutable SDL_atomic_t failed_;
+	GLuint *system_fbo_;
+	bool gles3_;
+	GLuint screen_fbo_;
+	GLuint fbo_;
+	GLuint texture_;
+	GLuint vbo_;
+	GLuint program_;
+	GLint tex_location_;
+	GLint size_location_;
+	GLint prescale_location_;
+	ivec2 texture_size_;
+	bool active_;
+	static int pack(ivec2 size) {
+		return (size.x << 16) | size.y;
+	}
+	static ivec2 unpack(int packed) {
+		ivec2 size = { packed >> 16, packed & 0xffff };
+		return size;
+	}
+	bool init() {
+		if (!resolve_gl() || !init_program())
+			return false;
+		init_timer();
+		screen_fbo_ = *system_fbo_;
+		gl_.GenTextures(1, &texture_);
+		gl_.GenFramebuffers(1, &fbo_);
+		static const GLfloat quad[] = { -1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f };
+		gl_.GenBuffers(1, &vbo_);
+		gl_.BindBuffer(GL_ARRAY_BUFFER, vbo_);
+		gl_.BufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+		gl_.BindBuffer(GL_ARRAY_BUFFER, 0);
+		return true;
+	}
+	bool resize_texture(ivec2 size) {
+		const GLint filter = filter_ == UF_Nearest ? GL_NEAREST : GL_LINEAR;
+		gl_.BindTexture(GL_TEXTURE_2D, texture_);
+		gl_.TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size.x, size.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+		gl_.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+		gl_.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+		gl_.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		gl_.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		gl_.BindTexture(GL_TEXTURE_2D, 0);
+		gl_.BindFramebuffer(GL_FRAMEBUFFER, fbo_);
+		gl_.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture_, 0);
+		const GLenum status = gl_.CheckFramebufferStatus(GL_FRAMEBUFFER);
+		gl_.BindFramebuffer(GL_FRAMEBUFFER, screen_fbo_);
+		if (status != GL_FRAMEBUFFER_COMPLETE) {
+			warn("upscaler: incomplete framebuffer (0x%x)", status);
+			return false;
+		}
+		texture_size_ = size;
+		return true;
+	}
+	/*
+	  Godot caches the current program, so the state is left as found. The
+	  vertex array binding is only queried with GLES3, as GLES2 has none.
+	 */
+	void blit(ivec2 output) {
+		GLint program, array_buffer, vertex_array = 0, active_texture, texture, viewport[4], attrib_enabled;
+		gl_.GetIntegerv(GL_CURRENT_PROGRAM, &program);
+		gl_.GetIntegerv(GL_ARRAY_BUFFER_BINDING, &array_buffer);
+		const bool vao = gles3_ && gl_.BindVertexArray;
+		if (vao)
+			gl_.GetIntegerv(GL_VERTEX_ARRAY_BINDING, &vertex_array);
+		gl_.GetIntegerv(GL_ACTIVE_TEXTURE, &active_texture);
+		gl_.ActiveTexture(GL_TEXTURE0);
+		gl_.GetIntegerv(GL_TEXTURE_BINDING_2D, &texture);
+		gl_.GetIntegerv(GL_VIEWPORT, viewport);
+		static const GLenum caps[] = { GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST, GL_SCISSOR_TEST, GL_STENCIL_TEST };
+		const int n_of_caps = sizeof(caps) / sizeof(caps[0]);
+		GLboolean enabled[n_of_caps];
+		for (int i = 0; i < n_of_caps; i++) {
+			enabled[i] = gl_.IsEnabled(caps[i]);
+			gl_.Disable(caps[i]);
+		}
+		if (vao)
+			gl_.BindVertexArray(0);
+		gl_.GetVertexAttribiv(0, GL_VERTEX_ATTRIB_ARRAY_ENABLED, &attrib_enabled);
+		gl_.BindFramebuffer(GL_FRAMEBUFFER, screen_fbo_);
+		gl_.Viewport(0, 0, output.x, output.y);
+		gl_.UseProgram(program_);
+		gl_.BindTexture(GL_TEXTURE_2D, texture_);
+		gl_.Uniform1i(tex_location_, 0);
+		gl_.Uniform2f(size_location_, texture_size_.x, texture_size_.y);
+		if (filter_ == UF_Sharp)
+			gl_.Uniform2f(prescale_location_, MAX(1, output.x / texture_size_.x), MAX(1, output.y / texture_size_.y));
+		else
+			gl_.Uniform2f(prescale_location_, 1.0f, 1.0f);
+		gl_.BindBuffer(GL_ARRAY_BUFFER, vbo_);
+		gl_.EnableVertexAttribArray(0);
+		gl_.VertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+		gl_.DrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		if (!attrib_enabled)
+			gl_.DisableVertexAttribArray(0);
+		gl_.BindBuffer(GL_ARRAY_BUFFER, array_buffer);
+		if (vao)
+			gl_.BindVertexArray(vertex_array);
+		gl_.BindTexture(GL_TEXTURE_2D, texture);
+		gl_.ActiveTexture(active_texture);
+		gl_.UseProgram(program);
+		gl_.Viewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+		for (int i = 0; i < n_of_caps; i++)
+			if (enabled[i])
+				gl_.Enable(caps[i]);
+	}
+public:
+	Upscaler() {
+		filter_ = parse_upscale_filter();
+		scale_ = parse_env_float("FRT_RENDER_SCALE", 1.0f, 0.1f, 1.0f);
+		SDL_AtomicSet(&render_size_, 0);
+		SDL_AtomicSet(&output_size_, 0);
+		SDL_AtomicSet(&gpu_time_usec_, -1);
+		initialized_ = false;
+		SDL_AtomicSet(&failed_, 0);
+		system_fbo_ = 0;
+		gles3_ = false;
+		timer_ = false;
+		next_query_ = 0;
+		n_pending_queries_ = 0;
+		query_active_ = false;
+		texture_size_.x = 0;
+		texture_size_.y = 0;
+		active_ = false;
+	}
+	void set_system_fbo(GLuint *system_fbo, bool gles3) {
+		system_fbo_ = system_fbo;
+		gles3_ = gles3;
+	}
+	void set_scale(float scale) {
+		if (scale > 0.0f && scale <= 1.0f)
+			scale_ = scale;
+	}
+	float get_scale() const {
+		return scale_;
+	}
+	ivec2 get_render_size(ivec2 output) const {
+		if (scale_ >= 1.0f || SDL_AtomicGet(&failed_))
+			return output;
+		ivec2 size = { MAX(1, (int)(output.x * scale_ + 0.5f)), MAX(1, (int)(output.y * scale_ + 0.5f)) };
+		return size;
+	}
+	// returns the size Godot should render at
+	ivec2 set_output_size(ivec2 output) {
+		const ivec2 size = get_render_size(output);
+		SDL_AtomicSet(&render_size_, pack(size));
+		SDL_AtomicSet(&output_size_, pack(output));
+		return size;
+	}
+	float get_gpu_time() const {
+		const int usec = SDL_AtomicGet(&gpu_time_usec_);
+		return usec < 0 ? -1.0f : usec / 1000.0f;
+	}
+	/*
+	  Called after swapping buffers (and once before the first frame, if
+	  possible): redirects the rendering of the next frame to the offscreen
+	  framebuffer if scaling. If initialization fails, the render size
+	  falls back to the output size.
+	 */
+	void begin_frame() {
+		if (!initialized_) {
+			initialized_ = true;
+			if (!init()) {
+				warn("upscaler: initialization failed, not scaling");
+				SDL_AtomicSet(&failed_, 1);
+			}
+		}
+		if (SDL_AtomicGet(&failed_))
+			return;
+		const ivec2 render = unpack(SDL_AtomicGet(&render_size_));
+		const ivec2 output = unpack(SDL_AtomicGet(&output_size_));
+		active_ = render.x != output.x || render.y != output.y;
+		if (active_ && (render.x != texture_size_.x || render.y != texture_size_.y) && !resize_texture(render))
+			active_ = false;
+		*system_fbo_ = active_ ? fbo_ : screen_fbo_;
+		gl_.BindFramebuffer(GL_FRAMEBUFFER, *system_fbo_);
+		if (timer_)
+			begin_query();
+	}
+	// called before swapping buffers
+	void end_frame() {
+		if (!initialized_ || SDL_AtomicGet(&failed_))
+			return;
+		if (active_)
+			blit(unpack(SDL_AtomicGet(&output_size_)));
+		if (timer_)
+			end_query();
+	}
+};
+
+class FRTSingleton : public Object {
+	GDCLASS(FRTSingleton, Object);
+private:
+	Godot3_OS *os_;
+protected:
+	static void _bind_methods();
+public:
+	FRTSingleton(Godot3_OS *os) : os_(os) {
+	}
+	int get_audio_underruns() const;
+	int get_audio_stalls() const;
+	int get_audio_capture_overruns() const;
+	float get_audio_round_trip_latency() const;
+	int get_audio_buffer_periods() const;
+	int get_input_event_allocations() const;
+	void set_joy_deadzone(int device, float deadzone);
+	float get_joy_deadzone(int device) const;
+	void set_joy_axis_epsilon(int device, float epsilon);
+	float get_joy_axis_epsilon(int device) const;
+	int get_joy_axis_events_dropped() const;
+	bool start_joy_trigger_vibration(int device, float left, float right, float duration);
+	int64_t get_joy_button_timestamp(int device) const;
+	void set_render_scale(float scale);
+	float get_render_scale() const;
+	float get_render_gpu_time() const;
 };
 
 class Godot3_OS : public OS_Unix, public EventHandler {
@@ -90,8 +662,25 @@ private:
 	VideoMode video_mode_;
 	bool quit_;
 	OS_FRT os_;
+	FramePacer pacer_;
 	int video_driver_;
 	VisualServer *visual_server_;
+	Upscaler upscaler_;
+	bool direct_to_screen_;
+	ivec2 output_size_;
+	Vector2 input_scale_; // output to render coordinates
+	void set_output_size(ivec2 size) {
+		if (size.x <= 0 || size.y <= 0)
+			return;
+		output_size_ = size;
+		const ivec2 render_size = upscaler_.set_output_size(size);
+		video_mode_.width = render_size.x;
+		video_mode_.height = render_size.y;
+		input_scale_ = Vector2((float)render_size.x / size.x, (float)render_size.y / size.y);
+	}
+	Vector2 to_render(ivec2 pos) const {
+		return Vector2(pos.x * input_scale_.x, pos.y * input_scale_.y);
+	}
 	void init_video() {
 		if (video_driver_ == VIDEO_DRIVER_GLES2) {
 			frt_resolve_symbols_gles2(get_proc_address);
@@ -103,7 +692,27 @@ private:
 			RasterizerGLES3::make_current();
 		}
 		visual_server_ = memnew(VisualServerRaster);
+		if (get_render_thread_mode() != RENDER_THREAD_UNSAFE)
+			visual_server_ = memnew(VisualServerWrapMT(visual_server_, get_render_thread_mode() == RENDER_SEPARATE_THREAD));
 		visual_server_->init();
+		if (video_driver_ == VIDEO_DRIVER_GLES2)
+			upscaler_.set_system_fbo(&RasterizerStorageGLES2::system_fbo, false);
+		else
+			upscaler_.set_system_fbo(&RasterizerStorageGLES3::system_fbo, true);
+		// otherwise, on the first swap, i.e. the first frame is not scaled
+		if (get_render_thread_mode() != RENDER_SEPARATE_THREAD)
+			upscaler_.begin_frame();
+	}
+	// see Upscaler
+	void check_direct_to_screen() {
+		SceneTree *tree = Object::cast_to<SceneTree>(main_loop_);
+		if (video_driver_ != VIDEO_DRIVER_GLES2 || !tree || !tree->get_root()->is_using_render_direct_to_screen())
+			return;
+		if (upscaler_.get_scale() < 1.0f) {
+			warn("upscaler: direct to screen rendering, not scaling");
+			set_render_scale(1.0f);
+		}
+		direct_to_screen_ = true;
 	}
 	void cleanup_video() {
 		visual_server_->finish();
@@ -115,15 +724,43 @@ private:
 	}
 	void cleanup_audio() {
 	}
+	FRTSingleton *singleton_;
+	void init_singleton() {
+		ClassDB::register_virtual_class<FRTSingleton>();
+		singleton_ = memnew(FRTSingleton(this));
+		Engine::get_singleton()->add_singleton(Engine::Singleton("FRT", singleton_));
+	}
+	void cleanup_singleton() {
+		memdelete(singleton_);
+	}
 	InputDefault *input_;
 	Point2 mouse_pos_;
 	int mouse_state_;
+	int event_allocations_;
+	int frame_event_allocations_;
+	EventPool<InputEventKey> key_events_;
+	EventPool<InputEventMouseMotion> mouse_motion_events_;
+	EventPool<InputEventMouseButton> mouse_button_events_;
+	EventPool<InputEventScreenTouch> touch_events_;
+	EventPool<InputEventScreenDrag> touch_drag_events_;
+	EventPool<InputEventJoypadButton> pad_button_events_;
+	EventPool<InputEventJoypadMotion> pad_motion_events_;
+	static const int MAX_JOY_TIMESTAMPS = 16;
+	uint64_t joy_timestamps_[MAX_JOY_TIMESTAMPS];
 	void init_input() {
-		input_ = memnew(InputDefault);
+		input_ = memnew(InputFRT(&os_));
 		mouse_pos_ = Point2(-1, -1);
 		mouse_state_ = 0;
+		memset(joy_timestamps_, 0, sizeof(joy_timestamps_));
 	}
 	void cleanup_input() {
+		key_events_.clear();
+		mouse_motion_events_.clear();
+		mouse_button_events_.clear();
+		touch_events_.clear();
+		touch_drag_events_.clear();
+		pad_button_events_.clear();
+		pad_motion_events_.clear();
 		memdelete(input_);
 	}
 	void fill_modifier_state(Ref<InputEventWithModifiers> st) {
@@ -133,17 +770,87 @@ private:
 		st->set_control(os_st->control);
 		st->set_metakey(os_st->meta);
 	}
+	/*
+	  With FRT_INPUT_THREAD, events are tagged with the time they were
+	  generated (in OS::get_ticks_usec time), as "frt_timestamp" metadata.
+	 */
+	void set_event_timestamp(InputEvent *ev) {
+		const int age = os_.get_event_age_usec();
+		if (age >= 0)
+			ev->set_meta("frt_timestamp", (int64_t)(get_ticks_usec() - age));
+		else if (ev->has_meta("frt_timestamp"))
+			ev->remove_meta("frt_timestamp");
+	}
+	void set_joy_timestamp(int id) {
+		const int age = os_.get_event_age_usec();
+		if (id >= 0 && id < MAX_JOY_TIMESTAMPS && age >= 0)
+			joy_timestamps_[id] = get_ticks_usec() - age;
+	}
+	void mouse_button_event(int os_button, bool pressed, bool doubleclick, float factor) {
+		int button = map_mouse_os_button(os_button);
+		int bit = (1 << (button - 1));
+		if (pressed)
+			mouse_state_ |= bit;
+		else
+			mouse_state_ &= ~bit;
+		Ref<InputEventMouseButton> mouse_button = mouse_button_events_.get();
+		fill_modifier_state(mouse_button);
+		Point2i posi(mouse_pos_.x, mouse_pos_.y);
+		mouse_button->set_position(posi);
+		mouse_button->set_global_position(posi);
+		mouse_button->set_button_index(button);
+		mouse_button->set_button_mask(mouse_state_);
+		mouse_button->set_doubleclick(doubleclick);
+		mouse_button->set_factor(factor);
+		mouse_button->set_pressed(pressed);
+		set_event_timestamp(mouse_button.ptr());
+		input_->parse_input_event(mouse_button);
+	}
 public:
-	Godot3_OS() : os_(this) {
+	Godot3_OS() : os_(this), event_allocations_(0), frame_event_allocations_(0), key_events_(&event_allocations_), mouse_motion_events_(&event_allocations_), mouse_button_events_(&event_allocations_), touch_events_(&event_allocations_), touch_drag_events_(&event_allocations_), pad_button_events_(&event_allocations_), pad_motion_events_(&event_allocations_) {
+		singleton_ = 0;
 		AudioDriverManager::add_driver(&audio_driver_);
 		main_loop_ = 0;
 		quit_ = false;
-	}
+		direct_to_screen_ = false;
+		output_size_.x = 0;
+		output_size_.y = 0;
+		input_scale_ = Vector2(1.0f, 1.0f);
+	}
+	/*
+	  In low processor usage mode, Main::iteration only draws when something
+	  changed, but still runs every low_processor_usage_mode_sleep_usec. When
+	  nothing was drawn, the loop also blocks on the event queue, so an idle
+	  application wakes up about 10 times per second instead of about 144
+	  (the default sleep is 6.9 ms). Input wakes it up right away, but timers
+	  not changing anything on screen may fire up to FRT_IDLE_WAIT late, as
+	  Godot doesn't expose the next timer deadline.
+	 */
 	void run() {
 		if (main_loop_) {
 			main_loop_->init();
-			while (!quit_ && !Main::iteration())
+			check_direct_to_screen();
+			pacer_.init(is_vsync_enabled() ? os_.get_screen_refresh_rate(-1) : 0.0f);
+			FrameTrace *trace = frame_trace;
+			while (!quit_) {
+				uint64_t t = trace ? trace->begin_frame() : 0;
+				const uint64_t frames_drawn = Engine::get_singleton()->get_frames_drawn();
+				if (Main::iteration())
+					break;
+				if (trace)
+					t = trace->add(FrameTrace::SpanIteration, t);
+				pacer_.frame_done();
+				pacer_.wait();
+				if (is_in_low_processor_usage_mode() && Engine::get_singleton()->get_frames_drawn() == frames_drawn)
+					os_.wait_events();
+				if (trace)
+					t = trace->add(FrameTrace::SpanWait, t);
 				os_.dispatch_events();
+				if (trace) {
+					trace->add(FrameTrace::SpanDispatch, t);
+					trace->end_frame();
+				}
+			}
 			main_loop_->finish();
 		}
 	}
@@ -189,14 +896,19 @@ public: // OS
 		return get_config_path();
 	}
 	Error initialize(const VideoMode &desired, int video_driver, int audio_driver) override {
+		init_frame_trace();
 		video_mode_ = desired;
 		video_driver_ = video_driver;
 		const GraphicsAPI api = video_driver == VIDEO_DRIVER_GLES3 ? API_OpenGL_ES3 : API_OpenGL_ES2;
 		os_.init_gl(api, video_mode_.width, video_mode_.height, video_mode_.resizable, video_mode_.borderless_window, video_mode_.always_on_top);
+		if (video_mode_.fullscreen)
+			os_.set_fullscreen(true);
+		set_output_size(os_.get_drawable_size());
 		_set_use_vsync(video_mode_.use_vsync);
 		init_video();
 		init_audio(audio_driver);
 		init_input();
+		init_singleton();
 		return OK;
 	}
 	void set_main_loop(MainLoop *main_loop) override {
@@ -210,10 +922,12 @@ public: // OS
 	}
 	void finalize() override {
 		delete_main_loop();
+		cleanup_singleton();
 		cleanup_input();
 		cleanup_audio();
 		cleanup_video();
 		os_.cleanup();
+		cleanup_frame_trace();
 	}
 	Point2 get_mouse_position() const override {
 		return mouse_pos_;
@@ -231,20 +945,46 @@ public: // OS
 		os_.set_title(title.utf8().get_data());
 	}
 	void set_video_mode(const VideoMode &video_mode, int screen) override {
+		ivec2 size = { video_mode.width, video_mode.height };
+		if (video_mode.fullscreen)
+			os_.set_fullscreen_size(size);
+		else
+			os_.set_size(size);
+		os_.set_fullscreen(video_mode.fullscreen);
+		os_.set_resizable(video_mode.resizable);
+		_set_use_vsync(video_mode.use_vsync);
+		video_mode_.fullscreen = video_mode.fullscreen;
+		video_mode_.resizable = video_mode.resizable;
+		video_mode_.use_vsync = video_mode.use_vsync;
 	}
 	VideoMode get_video_mode(int screen = 0) const override {
 		return video_mode_;
 	}
+	/*
+	  VideoMode has no refresh rate: modes only differing in it are listed
+	  once (see FRT_FULLSCREEN_REFRESH).
+	 */
 	void get_fullscreen_mode_list(List<VideoMode> *list, int screen) const override {
+		ivec2 last = { 0, 0 };
+		const int n = os_.get_fullscreen_mode_count(screen);
+		for (int i = 0; i < n; i++) {
+			ivec2 size;
+			int refresh_rate;
+			if (!os_.get_fullscreen_mode(screen, i, &size, &refresh_rate) || (size.x == last.x && size.y == last.y))
+				continue;
+			list->push_back(VideoMode(size.x, size.y, true));
+			last = size;
+		}
 	}
+	// the render size, which falls back to the output size if scaling fails
 	Size2 get_window_size() const override {
-		return Size2(video_mode_.width, video_mode_.height);
+		const ivec2 size = upscaler_.get_render_size(output_size_);
+		return Size2(size.x, size.y);
 	}
 	void set_window_size(const Size2 size) override {
 		ivec2 os_size = { (int)size.width, (int)size.height };
 		os_.set_size(os_size);
-		video_mode_.width = os_size.x;
-		video_mode_.height = os_size.y;
+		set_output_size(os_size);
 	}
 	Point2 get_window_position() const override {
 		ivec2 pos = os_.get_pos();
@@ -286,6 +1026,9 @@ public: // OS
 	bool is_window_minimized() const override {
 		return os_.is_minimized();
 	}
+	bool is_window_focused() const override {
+		return os_.is_focused();
+	}
 	MainLoop *get_main_loop() const override {
 		return main_loop_;
 	}
@@ -303,7 +1046,9 @@ public: // OS
 		os_.release_current_gl();
 	}
 	void swap_buffers() override {
+		upscaler_.end_frame();
 		os_.swap_buffers_gl();
+		upscaler_.begin_frame();
 	}
 	void _set_use_vsync(bool enable) override {
 		os_.set_use_vsync_gl(enable);
@@ -316,72 +1061,107 @@ public: // OS
 		PoolVector<uint8_t>::Read r = i->get_data().read();
 		os_.set_icon(i->get_width(), i->get_height(), r.ptr());
 	}
+	int get_screen_count() const override {
+		return os_.get_screen_count();
+	}
+	int get_current_screen() const override {
+		return os_.get_display();
+	}
+	void set_current_screen(int screen) override {
+		os_.set_screen(screen);
+	}
+	Point2 get_screen_position(int screen) const override {
+		ivec2 pos = os_.get_screen_pos(screen);
+		return Point2(pos.x, pos.y);
+	}
 	Size2 get_screen_size(int screen) const override {
-		ivec2 size = os_.get_screen_size();
+		ivec2 size = os_.get_screen_size(screen);
 		return Size2(size.x, size.y);
 	}
 	int get_screen_dpi(int screen) const override {
-		return os_.get_screen_dpi();
+		return os_.get_screen_dpi(screen);
 	}
 	float get_screen_refresh_rate(int screen) const override {
-		return os_.get_screen_refresh_rate();
+		return os_.get_screen_refresh_rate(screen);
 	}
 public: // EventHandler
 	void handle_resize_event(ivec2 size) override {
-		video_mode_.width = size.x;
-		video_mode_.height = size.y;
+		set_output_size(size);
+	}
+	void handle_focus_event(bool focused) override {
+		if (!focused)
+			input_->release_pressed_events();
+		if (main_loop_)
+			main_loop_->notification(focused ? MainLoop::NOTIFICATION_WM_FOCUS_IN : MainLoop::NOTIFICATION_WM_FOCUS_OUT);
+	}
+	void handle_mouse_enter_event(bool entered) override {
+		if (main_loop_)
+			main_loop_->notification(entered ? MainLoop::NOTIFICATION_WM_MOUSE_ENTER : MainLoop::NOTIFICATION_WM_MOUSE_EXIT);
 	}
-	void handle_key_event(int sdl2_code, int unicode, bool pressed) override {
-		int code = map_key_sdl2_code(sdl2_code);
-		Ref<InputEventKey> key;
-		key.instance();
+	// redraw in low processor usage mode
+	void handle_expose_event() override {
+		Main::force_redraw();
+	}
+	void handle_key_event(int sdl2_code, int sdl2_scancode, int unicode, bool pressed, bool echo) override {
+		Ref<InputEventKey> key = key_events_.get();
 		fill_modifier_state(key);
 		key->set_pressed(pressed);
-		key->set_scancode(code);
-		key->set_physical_scancode(code); // TODO
+		key->set_scancode(map_key_sdl2_code(sdl2_code));
+		key->set_physical_scancode(map_key_sdl2_scancode(sdl2_scancode));
 		key->set_unicode(unicode);
-		key->set_echo(false);
+		key->set_echo(echo);
+		set_event_timestamp(key.ptr());
 		input_->parse_input_event(key);
 	}
 	void handle_mouse_motion_event(ivec2 pos, ivec2 dpos) override {
-		mouse_pos_.x = pos.x;
-		mouse_pos_.y = pos.y;
-		Ref<InputEventMouseMotion> mouse_motion;
-		mouse_motion.instance();
+		mouse_pos_ = to_render(pos);
+		Ref<InputEventMouseMotion> mouse_motion = mouse_motion_events_.get();
 		fill_modifier_state(mouse_motion);
-		Point2i posi(pos.x, pos.y);
 		mouse_motion->set_button_mask(mouse_state_);
-		mouse_motion->set_position(posi);
-		mouse_motion->set_global_position(posi);
-		input_->set_mouse_position(posi);
+		mouse_motion->set_position(mouse_pos_);
+		mouse_motion->set_global_position(mouse_pos_);
+		input_->set_mouse_position(mouse_pos_);
 		mouse_motion->set_speed(input_->get_last_mouse_speed());
-		Point2i reli(dpos.x, dpos.y);
-		mouse_motion->set_relative(reli);
+		mouse_motion->set_relative(to_render(dpos));
+		set_event_timestamp(mouse_motion.ptr());
 		input_->parse_input_event(mouse_motion);
 	}
 	void handle_mouse_button_event(int os_button, bool pressed, bool doubleclick) override {
-		int button = map_mouse_os_button(os_button);
-		int bit = (1 << (button - 1));
-		if (pressed)
-			mouse_state_ |= bit;
-		else
-			mouse_state_ &= ~bit;
-		Ref<InputEventMouseButton> mouse_button;
-		mouse_button.instance();
-		fill_modifier_state(mouse_button);
-		Point2i posi(mouse_pos_.x, mouse_pos_.y);
-		mouse_button->set_position(posi);
-		mouse_button->set_global_position(posi);
-		mouse_button->set_button_index(button);
-		mouse_button->set_button_mask(mouse_state_);
-		mouse_button->set_doubleclick(doubleclick);
-		mouse_button->set_pressed(pressed);
-		input_->parse_input_event(mouse_button);
+		mouse_button_event(os_button, pressed, doubleclick, 1.0f);
+	}
+	void handle_mouse_wheel_event(int os_button, float factor) override {
+		mouse_button_event(os_button, true, false, factor);
+		mouse_button_event(os_button, false, false, factor);
+	}
+	void handle_touch_event(int index, bool pressed, ivec2 pos) override {
+		Ref<InputEventScreenTouch> touch = touch_events_.get();
+		touch->set_index(index);
+		touch->set_position(to_render(pos));
+		touch->set_pressed(pressed);
+		set_event_timestamp(touch.ptr());
+		input_->parse_input_event(touch);
+	}
+	void handle_touch_drag_event(int index, ivec2 pos, ivec2 dpos) override {
+		Ref<InputEventScreenDrag> drag = touch_drag_events_.get();
+		drag->set_index(index);
+		drag->set_position(to_render(pos));
+		drag->set_relative(to_render(dpos));
+		set_event_timestamp(drag.ptr());
+		input_->parse_input_event(drag);
 	}
 	void handle_js_status_event(int id, bool connected, const char *name, const char *guid) override {
 		input_->joy_connection_changed(id, connected, name, guid);
 	}
+	/*
+	  SDL has already mapped the buttons and axes of a game controller, so
+	  their events are sent as they are, bypassing joy_button and joy_axis,
+	  which would map them again if Godot has a mapping for the GUID.
+	 */
+	void handle_js_pad_status_event(int id, const char *name, const char *guid) override {
+		input_->joy_connection_changed(id, true, name, guid);
+	}
 	void handle_js_button_event(int id, int button, bool pressed) override {
+		set_joy_timestamp(id);
 		input_->joy_button(id, button, pressed ? 1 : 0);
 	}
 	void handle_js_axis_event(int id, int axis, float value) override {
@@ -391,6 +1171,28 @@ public: // EventHandler
 		int mask = map_hat_os_mask(os_mask);
 		input_->joy_hat(id, mask);
 	}
+	void handle_js_pad_button_event(int id, int sdl2_button, bool pressed) override {
+		int button = map_pad_sdl2_button(sdl2_button);
+		if (button < 0)
+			return;
+		set_joy_timestamp(id);
+		Ref<InputEventJoypadButton> pad_button = pad_button_events_.get();
+		pad_button->set_device(id);
+		pad_button->set_button_index(button);
+		pad_button->set_pressed(pressed);
+		pad_button->set_pressure(0.0f);
+		input_->parse_input_event(pad_button);
+	}
+	void handle_js_pad_axis_event(int id, int sdl2_axis, float value) override {
+		int axis = map_pad_sdl2_axis(sdl2_axis);
+		if (axis < 0)
+			return;
+		Ref<InputEventJoypadMotion> pad_motion = pad_motion_events_.get();
+		pad_motion->set_device(id);
+		pad_motion->set_axis(axis);
+		pad_motion->set_axis_value(value);
+		input_->parse_input_event(pad_motion);
+	}
 	void handle_js_vibra_event(int id, uint64_t timestamp) override {
 		uint64_t input_timestamp = input_->get_joy_vibration_timestamp(id);
 		if (input_timestamp > timestamp) {
@@ -404,9 +1206,132 @@ public: // EventHandler
 	}
 	void handle_flush_events() override {
 		input_->flush_buffered_events();
+		frame_event_allocations_ = event_allocations_;
+		event_allocations_ = 0;
+	}
+public: // FRTSingleton
+	AudioDriverSDL2 *get_audio_driver() {
+		return &audio_driver_;
+	}
+	int get_frame_event_allocations() const {
+		return frame_event_allocations_;
+	}
+	OS_FRT *get_frt_os() {
+		return &os_;
+	}
+	uint64_t get_joy_timestamp(int id) const {
+		return id >= 0 && id < MAX_JOY_TIMESTAMPS ? joy_timestamps_[id] : 0;
+	}
+	Upscaler *get_upscaler() {
+		return &upscaler_;
+	}
+	void set_render_scale(float scale) {
+		if (direct_to_screen_)
+			return;
+		upscaler_.set_scale(scale);
+		set_output_size(output_size_);
 	}
 };
 
+void FRTSingleton::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("get_audio_underruns"), &FRTSingleton::get_audio_underruns);
+	ClassDB::bind_method(D_METHOD("get_audio_stalls"), &FRTSingleton::get_audio_stalls);
+	ClassDB::bind_method(D_METHOD("get_audio_capture_overruns"), &FRTSingleton::get_audio_capture_overruns);
+	ClassDB::bind_method(D_METHOD("get_audio_round_trip_latency"), &FRTSingleton::get_audio_round_trip_latency);
+	ClassDB::bind_method(D_METHOD("get_audio_buffer_periods"), &FRTSingleton::get_audio_buffer_periods);
+	ClassDB::bind_method(D_METHOD("get_input_event_allocations"), &FRTSingleton::get_input_event_allocations);
+	ClassDB::bind_method(D_METHOD("set_joy_deadzone", "device", "deadzone"), &FRTSingleton::set_joy_deadzone);
+	ClassDB::bind_method(D_METHOD("get_joy_deadzone", "device"), &FRTSingleton::get_joy_deadzone);
+	ClassDB::bind_method(D_METHOD("set_joy_axis_epsilon", "device", "epsilon"), &FRTSingleton::set_joy_axis_epsilon);
+	ClassDB::bind_method(D_METHOD("get_joy_axis_epsilon", "device"), &FRTSingleton::get_joy_axis_epsilon);
+	ClassDB::bind_method(D_METHOD("get_joy_axis_events_dropped"), &FRTSingleton::get_joy_axis_events_dropped);
+	ClassDB::bind_method(D_METHOD("start_joy_trigger_vibration", "device", "left", "right", "duration"), &FRTSingleton::start_joy_trigger_vibration);
+	ClassDB::bind_method(D_METHOD("get_joy_button_timestamp", "device"), &FRTSingleton::get_joy_button_timestamp);
+	ClassDB::bind_method(D_METHOD("set_render_scale", "scale"), &FRTSingleton::set_render_scale);
+	ClassDB::bind_method(D_METHOD("get_render_scale"), &FRTSingleton::get_render_scale);
+	ClassDB::bind_method(D_METHOD("get_render_gpu_time"), &FRTSingleton::get_render_gpu_time);
+}
+
+int FRTSingleton::get_audio_underruns() const {
+	return os_->get_audio_driver()->get_audio()->get_underruns();
+}
+
+// times the device stopped consuming frames (e.g. lost)
+int FRTSingleton::get_audio_stalls() const {
+	return os_->get_audio_driver()->get_audio()->get_stalls();
+}
+
+int FRTSingleton::get_audio_capture_overruns() const {
+	return os_->get_audio_driver()->get_audio()->get_capture_overruns();
+}
+
+/*
+  Capture + playback, in seconds (0 if not capturing). An estimate based on
+  the average fill of the ring buffers and the device periods, not a
+  measurement: the latency of the devices themselves is not included.
+ */
+float FRTSingleton::get_audio_round_trip_latency() const {
+	Audio *audio = os_->get_audio_driver()->get_audio();
+	float capture_latency = audio->get_capture_latency();
+	if (capture_latency == 0.0f)
+		return 0.0f;
+	return capture_latency + audio->get_output_latency();
+}
+
+int FRTSingleton::get_audio_buffer_periods() const {
+	return os_->get_audio_driver()->get_audio()->get_buffer_periods();
+}
+
+// during the last frame
+int FRTSingleton::get_input_event_allocations() const {
+	return os_->get_frame_event_allocations();
+}
+
+void FRTSingleton::set_joy_deadzone(int device, float deadzone) {
+	os_->get_frt_os()->set_js_deadzone(device, deadzone);
+}
+
+float FRTSingleton::get_joy_deadzone(int device) const {
+	return os_->get_frt_os()->get_js_deadzone(device);
+}
+
+void FRTSingleton::set_joy_axis_epsilon(int device, float epsilon) {
+	os_->get_frt_os()->set_js_epsilon(device, epsilon);
+}
+
+float FRTSingleton::get_joy_axis_epsilon(int device) const {
+	return os_->get_frt_os()->get_js_epsilon(device);
+}
+
+// filtered out or merged, since startup
+int FRTSingleton::get_joy_axis_events_dropped() const {
+	return os_->get_frt_os()->get_js_axis_events_dropped();
+}
+
+// false if not supported by the device (or SDL < 2.0.14)
+bool FRTSingleton::start_joy_trigger_vibration(int device, float left, float right, float duration) {
+	return os_->get_frt_os()->js_trigger_vibra(device, left, right, duration);
+}
+
+// of the last button event, in OS::get_ticks_usec() time (0 if unknown, see FRT_INPUT_THREAD)
+int64_t FRTSingleton::get_joy_button_timestamp(int device) const {
+	return (int64_t)os_->get_joy_timestamp(device);
+}
+
+// (0, 1], applied from the next frame
+void FRTSingleton::set_render_scale(float scale) {
+	os_->set_render_scale(scale);
+}
+
+float FRTSingleton::get_render_scale() const {
+	return os_->get_upscaler()->get_scale();
+}
+
+// of a recent frame, in milliseconds (-1 if not available)
+float FRTSingleton::get_render_gpu_time() const {
+	return os_->get_upscaler()->get_gpu_time();
+}
+
 } // namespace frt
 
 #include "frt_lib.h"
@@ -12,21 +12,20 @@
   Unicode
 
   Keyboard/Text SDL2 events don't map very well to Godot input events.
-  If a SDL2 keypress event might need to be "translated", that event is saved
-  and passed to Godot only when a translation is received.
-  This is incomplete and likely to be a source of bugs. Ctrl+... combinations
-  for example don't seem to generate a translation. Multiple keypresses
-  are also going to have a wrong unicode traslation.
-  Still, this implementation seems a good compromise: simple enough,
-  yet functional enough.
-  The 2D platformer feels responsive (even when adding WASD input mappings
-  and pressing multiple keys), and the editor is usable for basic code editing
-  (tested with US and IT keymaps).
+  If a SDL2 keypress event might need to be "translated", that event is queued
+  and passed to Godot when a translation is received, in order, or when the
+  key is released or at the end of the frame without one (e.g. Ctrl+...
+  combinations). This assumes that text events follow their keypresses, which
+  is not the case with input methods composing a character from multiple
+  keypresses: the composed text is then sent as a separate press and release
+  of a key with no scancode.
 
  */
 
 #include <SDL.h>
 
+#include "audio_convert.h"
+
 /*
 
   SDL VERSION COMPATIBILITY:
@@ -36,23 +35,35 @@
   current crossbuild are:
   - 2.0.5+ (debian stretch)
 
-  The only used feature missing in SDL 2.0.5 is rumble support,
-  and it is dynamically resolved. Resolution could be factored out, but for now
-  it seems overkill.
+  The only used features missing in SDL 2.0.5 are rumble support (including
+  trigger rumble) and the query of the default audio device, and they are
+  dynamically resolved.
+  Resolution could be factored out, but for now it seems overkill.
 
  */
 
 #include <dlfcn.h>
+#include <signal.h>
 
 typedef int (*FRT_SDL_JoystickRumble)(SDL_Joystick *, Uint16, Uint16, Uint32);
 FRT_SDL_JoystickRumble frt_SDL_JoystickRumble = 0;
 #define SDL_JoystickRumble frt_SDL_JoystickRumble
 
+typedef int (*FRT_SDL_JoystickRumbleTriggers)(SDL_Joystick *, Uint16, Uint16, Uint32);
+FRT_SDL_JoystickRumbleTriggers frt_SDL_JoystickRumbleTriggers = 0;
+#define SDL_JoystickRumbleTriggers frt_SDL_JoystickRumbleTriggers
+
+typedef int (*FRT_SDL_GetDefaultAudioInfo)(char **, SDL_AudioSpec *, int);
+FRT_SDL_GetDefaultAudioInfo frt_SDL_GetDefaultAudioInfo = 0;
+#define SDL_GetDefaultAudioInfo frt_SDL_GetDefaultAudioInfo
+
 void frt_resolve_symbols_sdl2() {
 	void *lib = dlopen(0, RTLD_LAZY);
 	if (!lib)
 		return;
 	frt_SDL_JoystickRumble = (FRT_SDL_JoystickRumble)dlsym(lib, "SDL_JoystickRumble");
+	frt_SDL_JoystickRumbleTriggers = (FRT_SDL_JoystickRumbleTriggers)dlsym(lib, "SDL_JoystickRumbleTriggers");
+	frt_SDL_GetDefaultAudioInfo = (FRT_SDL_GetDefaultAudioInfo)dlsym(lib, "SDL_GetDefaultAudioInfo");
 	dlclose(lib);
 }
 
@@ -60,44 +71,885 @@ namespace frt {
 
 void *(*get_proc_address)(const char *) = SDL_GL_GetProcAddress;
 
+// environment variables
+
+bool parse_env_bool(const char *name, bool default_value) {
+	const char *s = getenv(name);
+	if (!s || !*s)
+		return default_value;
+	if (!strcmp(s, "1") || !strcmp(s, "yes") || !strcmp(s, "true"))
+		return true;
+	else if (!strcmp(s, "0") || !strcmp(s, "no") || !strcmp(s, "false"))
+		return false;
+	warn("invalid %s (%s), using: %d", name, s, default_value ? 1 : 0);
+	return default_value;
+}
+
+int parse_env_int(const char *name, int default_value, int min_value, int max_value) {
+	const char *s = getenv(name);
+	if (!s || !*s)
+		return default_value;
+	char *end;
+	long value = strtol(s, &end, 10);
+	if (*end || value < min_value || value > max_value) {
+		warn("invalid %s (%s), using: %d", name, s, default_value);
+		return default_value;
+	}
+	return (int)value;
+}
+
+float parse_env_float(const char *name, float default_value, float min_value, float max_value) {
+	const char *s = getenv(name);
+	if (!s || !*s)
+		return default_value;
+	char *end;
+	float value = strtof(s, &end);
+	if (*end || value < min_value || value > max_value) {
+		warn("invalid %s (%s), using: %g", name, s, default_value);
+		return default_value;
+	}
+	return value;
+}
+
+enum ExitShortcut {
+	ES_None,
+	ES_ShiftEnter,
+	ES_WinQ,
+	ES_Esc
+};
+
+ExitShortcut parse_exit_shortcut() {
+	const char *s = getenv("FRT_EXIT_SHORTCUT");
+	if (!s || !strcmp(s, "none"))
+		return ES_None;
+	else if (!strcmp(s, "shift-enter"))
+		return ES_ShiftEnter;
+	else if (!strcmp(s, "win-q"))
+		return ES_WinQ;
+	else if (!strcmp(s, "esc"))
+		return ES_Esc;
+	warn("invalid FRT_EXIT_SHORTCUT (%s), using: esc", s);
+	return ES_Esc;
+}
+
+SampleKernel parse_sample_kernel() {
+	const char *s = getenv("FRT_AUDIO_KERNEL");
+	if (!s || !strcmp(s, "auto"))
+		return SK_Auto;
+	else if (!strcmp(s, "scalar"))
+		return SK_Scalar;
+	else if (!strcmp(s, "sse2"))
+		return SK_SSE2;
+	else if (!strcmp(s, "neon"))
+		return SK_NEON;
+	warn("invalid FRT_AUDIO_KERNEL (%s), using: auto", s);
+	return SK_Auto;
+}
+
+// 0: auto
+SDL_AudioFormat parse_sample_format() {
+	const char *s = getenv("FRT_AUDIO_FORMAT");
+	if (!s || !strcmp(s, "auto"))
+		return 0;
+	else if (!strcmp(s, "s16"))
+		return AUDIO_S16SYS;
+	else if (!strcmp(s, "s32"))
+		return AUDIO_S32SYS;
+	else if (!strcmp(s, "f32"))
+		return AUDIO_F32SYS;
+	warn("invalid FRT_AUDIO_FORMAT (%s), using: auto", s);
+	return 0;
+}
+
+// 0: auto
+int parse_audio_channels() {
+	int channels = parse_env_int("FRT_AUDIO_CHANNELS", 0, 0, 8);
+	if (channels & 1) {
+		warn("invalid FRT_AUDIO_CHANNELS (%d), using: 0", channels);
+		return 0;
+	}
+	return channels;
+}
+
+enum MouseMotionPolicy {
+	MM_Raw,
+	MM_Coalesce
+};
+
+MouseMotionPolicy parse_mouse_motion() {
+	const char *s = getenv("FRT_MOUSE_MOTION");
+	if (!s || !strcmp(s, "raw"))
+		return MM_Raw;
+	else if (!strcmp(s, "coalesce"))
+		return MM_Coalesce;
+	warn("invalid FRT_MOUSE_MOTION (%s), using: raw", s);
+	return MM_Raw;
+}
+
+enum JoystickBackend {
+	JB_Joystick,
+	JB_GameController
+};
+
+JoystickBackend parse_joystick_backend() {
+	const char *s = getenv("FRT_JOYSTICK");
+	if (!s || !strcmp(s, "joystick"))
+		return JB_Joystick;
+	else if (!strcmp(s, "gamecontroller"))
+		return JB_GameController;
+	warn("invalid FRT_JOYSTICK (%s), using: joystick", s);
+	return JB_Joystick;
+}
+
+enum FullscreenMode {
+	FM_Desktop,
+	FM_Exclusive
+};
+
+FullscreenMode parse_fullscreen_mode() {
+	const char *s = getenv("FRT_FULLSCREEN");
+	if (!s || !strcmp(s, "desktop"))
+		return FM_Desktop;
+	else if (!strcmp(s, "exclusive"))
+		return FM_Exclusive;
+	warn("invalid FRT_FULLSCREEN (%s), using: desktop", s);
+	return FM_Desktop;
+}
+
+enum UpscaleFilter {
+	UF_Nearest,
+	UF_Bilinear,
+	UF_Sharp
+};
+
+UpscaleFilter parse_upscale_filter() {
+	const char *s = getenv("FRT_RENDER_FILTER");
+	if (!s || !strcmp(s, "bilinear"))
+		return UF_Bilinear;
+	else if (!strcmp(s, "nearest"))
+		return UF_Nearest;
+	else if (!strcmp(s, "sharp"))
+		return UF_Sharp;
+	warn("invalid FRT_RENDER_FILTER (%s), using: bilinear", s);
+	return UF_Bilinear;
+}
+
+/*
+  Frame timing instrumentation (FRT_TRACE=file, or --frt -t file).
+
+  Each frame of the main loop records when it started and how long it spent
+  in Main::iteration(), waiting (frame pacing, idling) and dispatching events.
+  Time spent swapping buffers (also part of the iteration, unless rendering
+  in a separate thread) and in the audio callback is accumulated from any
+  thread and assigned to the frame being recorded.
+
+  Frames are kept in a preallocated ring (FRT_TRACE_FRAMES, default 3600)
+  and written on exit or on SIGUSR1, as Chrome trace JSON if the file name
+  ends with .json, as CSV otherwise.
+ */
+class FrameTrace {
+public:
+	enum Span {
+		SpanIteration,
+		SpanWait,
+		SpanDispatch,
+		SpanSwap,
+		SpanAudio,
+		N_OF_SPANS
+	};
+private:
+	struct Frame {
+		uint64_t start;
+		uint32_t us[N_OF_SPANS];
+	};
+	const char *path_;
+	Frame *frames_;
+	int size_;
+	int count_;
+	uint64_t freq_;
+	uint64_t origin_;
+	SDL_atomic_t async_us_[N_OF_SPANS];
+	static volatile sig_atomic_t dump_requested_;
+	static void handle_signal(int) {
+		dump_requested_ = 1;
+	}
+	uint32_t elapsed_us(uint64_t t0, uint64_t t1) const {
+		return (uint32_t)((t1 - t0) * 1000000 / freq_);
+	}
+	const Frame &get_frame(int i) const {
+		const int first = count_ > size_ ? count_ - size_ : 0;
+		return frames_[(first + i) % size_];
+	}
+	void write_csv(FILE *f, int n) const {
+		fprintf(f, "frame,start_us,iteration_us,wait_us,dispatch_us,swap_us,audio_us\n");
+		const int first = count_ - n;
+		for (int i = 0; i < n; i++) {
+			const Frame &fr = get_frame(i);
+			fprintf(f, "%d,%llu,%u,%u,%u,%u,%u\n", first + i, (unsigned long long)fr.start,
+					fr.us[SpanIteration], fr.us[SpanWait], fr.us[SpanDispatch], fr.us[SpanSwap], fr.us[SpanAudio]);
+		}
+	}
+	void write_json(FILE *f, int n) const {
+		static const char *names[] = { "iteration", "wait", "dispatch", "swap", "audio" };
+		fprintf(f, "{\"traceEvents\":[\n");
+		const char *sep = "";
+		for (int i = 0; i < n; i++) {
+			const Frame &fr = get_frame(i);
+			unsigned long long ts = fr.start;
+			for (int span = SpanIteration; span <= SpanDispatch; span++) {
+				fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":1,\"tid\":1}", sep, names[span], ts, fr.us[span]);
+				sep = ",\n";
+				ts += fr.us[span];
+			}
+			for (int span = SpanSwap; span < N_OF_SPANS; span++)
+				fprintf(f, ",\n{\"name\":\"%s_us\",\"ph\":\"C\",\"ts\":%llu,\"pid\":1,\"args\":{\"us\":%u}}", names[span], (unsigned long long)fr.start, fr.us[span]);
+		}
+		fprintf(f, "\n]}\n");
+	}
+public:
+	FrameTrace(const char *path, int size) : path_(path), size_(size), count_(0) {
+		frames_ = new Frame[size_];
+		freq_ = SDL_GetPerformanceFrequency();
+		origin_ = SDL_GetPerformanceCounter();
+		for (int i = 0; i < N_OF_SPANS; i++)
+			SDL_AtomicSet(&async_us_[i], 0);
+		signal(SIGUSR1, handle_signal);
+	}
+	~FrameTrace() {
+		delete[] frames_;
+	}
+	static uint64_t now() {
+		return SDL_GetPerformanceCounter();
+	}
+	// main thread
+	uint64_t begin_frame() {
+		const uint64_t t = now();
+		Frame &fr = frames_[count_ % size_];
+		fr.start = (t - origin_) * 1000000 / freq_;
+		memset(fr.us, 0, sizeof(fr.us));
+		return t;
+	}
+	// main thread, returns the end of the span
+	uint64_t add(Span span, uint64_t t0) {
+		const uint64_t t1 = now();
+		frames_[count_ % size_].us[span] += elapsed_us(t0, t1);
+		return t1;
+	}
+	// any thread
+	void add_async(Span span, uint64_t t0) {
+		SDL_AtomicAdd(&async_us_[span], (int)elapsed_us(t0, now()));
+	}
+	// main thread
+	void end_frame() {
+		Frame &fr = frames_[count_ % size_];
+		for (int i = 0; i < N_OF_SPANS; i++)
+			fr.us[i] += (uint32_t)SDL_AtomicSet(&async_us_[i], 0);
+		count_++;
+		if (dump_requested_) {
+			dump_requested_ = 0;
+			dump();
+		}
+	}
+	void dump() const {
+		FILE *f = fopen(path_, "w");
+		if (!f) {
+			warn("cannot write %s", path_);
+			return;
+		}
+		const int n = count_ < size_ ? count_ : size_;
+		const size_t len = strlen(path_);
+		if (len > 5 && !strcmp(path_ + len - 5, ".json"))
+			write_json(f, n);
+		else
+			write_csv(f, n);
+		fclose(f);
+	}
+};
+
+volatile sig_atomic_t FrameTrace::dump_requested_ = 0;
+
+FrameTrace *frame_trace = 0;
+
+void init_frame_trace() {
+	const char *path = getenv("FRT_TRACE");
+	if (!path || !*path)
+		return;
+	frame_trace = new FrameTrace(path, parse_env_int("FRT_TRACE_FRAMES", 3600, 1, 1000000));
+}
+
+void cleanup_frame_trace() {
+	if (!frame_trace)
+		return;
+	frame_trace->dump();
+	delete frame_trace;
+	frame_trace = 0;
+}
+
+// calls are made from the mixer thread, while holding the audio lock
 struct SampleProducer {
 	virtual void produce_samples(int n_of_frames, int32_t *frames) = 0;
+	virtual void consume_samples(int n_of_frames, const int32_t *frames) = 0;
 	virtual ~SampleProducer();
 };
 
 SampleProducer::~SampleProducer() {
 }
 
+/*
+  Lock-free single-producer/single-consumer ring buffer.
+
+  Sizes are in bytes and the capacity is rounded up to a power of two.
+  Head and tail are free running counters: head is only written by the
+  producer, tail is only written by the consumer. SDL_AtomicSet is only
+  an acquire barrier with some compilers, so explicit barriers order the
+  data copies with the counter updates: the data must be written (or read)
+  before the counter is published, and the other side's counter must be
+  read before the data.
+ */
+class RingBuffer {
+private:
+	uint8_t *data_;
+	int size_;
+	int mask_;
+	SDL_atomic_t head_;
+	SDL_atomic_t tail_;
+public:
+	RingBuffer() : data_(0), size_(0), mask_(0) {
+		SDL_AtomicSet(&head_, 0);
+		SDL_AtomicSet(&tail_, 0);
+	}
+	~RingBuffer() {
+		delete[] data_;
+	}
+	void init(int min_size) {
+		size_ = 1;
+		while (size_ < min_size)
+			size_ <<= 1;
+		mask_ = size_ - 1;
+		delete[] data_;
+		data_ = new uint8_t[size_];
+		SDL_AtomicSet(&head_, 0);
+		SDL_AtomicSet(&tail_, 0);
+	}
+	// no producer or consumer running
+	void reset() {
+		SDL_AtomicSet(&head_, 0);
+		SDL_AtomicSet(&tail_, 0);
+	}
+	void cleanup() {
+		delete[] data_;
+		data_ = 0;
+		size_ = mask_ = 0;
+	}
+	int get_size() const {
+		return size_;
+	}
+	int available() {
+		int n = (int)((unsigned)SDL_AtomicGet(&head_) - (unsigned)SDL_AtomicGet(&tail_));
+		SDL_MemoryBarrierAcquire();
+		return n;
+	}
+	int space() {
+		return size_ - available();
+	}
+	// producer only, n <= space()
+	void write(const void *src, int n) {
+		unsigned head = (unsigned)SDL_AtomicGet(&head_);
+		int pos = head & mask_;
+		int first = n < size_ - pos ? n : size_ - pos;
+		memcpy(data_ + pos, src, first);
+		memcpy(data_, (const uint8_t *)src + first, n - first);
+		SDL_MemoryBarrierRelease();
+		SDL_AtomicSet(&head_, (int)(head + n));
+	}
+	// consumer only, n <= available()
+	void read(void *dst, int n) {
+		unsigned tail = (unsigned)SDL_AtomicGet(&tail_);
+		int pos = tail & mask_;
+		int first = n < size_ - pos ? n : size_ - pos;
+		memcpy(dst, data_ + pos, first);
+		memcpy((uint8_t *)dst + first, data_, n - first);
+		SDL_MemoryBarrierRelease();
+		SDL_AtomicSet(&tail_, (int)(tail + n));
+	}
+};
+
 void audio_callback(void *userdata, Uint8 *stream, int len);
+void capture_callback(void *userdata, Uint8 *stream, int len);
+
+/*
+  Godot is mixed in a dedicated thread, one device period at a time, and the
+  converted frames are queued in a ring buffer. The SDL2 callback only copies
+  frames out of the ring, so a main thread holding lock() can delay the mixer,
+  but not the device.
+
+  The device is asked for int32 samples and for the channels of the default
+  device (if SDL2 can tell), but accepts int16 or float32 samples as well.
+  SDL2 has no 3.1 layout, so Godot 3.1 is played on a 5.1 device.
 
+  Devices are switched (or reopened when lost) by the mixer thread: the old
+  device fades out over one period and is drained, then the new one is
+  opened and fades in, so there is a short gap of silence. A true crossfade
+  would need both devices open and fed at once, each one with its own clock
+  and period size, which is not worth it (and some drivers can't open a
+  second device while the first one is open). set_device() only stores the
+  name and, when the mixer is running, asks it to switch.
+
+  Captured frames (always stereo int32) are queued by the SDL2 capture
+  callback in a second ring buffer, and passed to Godot by the mixer thread
+  before mixing each period. The capture device is opened and closed by the
+  mixer thread as well, since Godot asks for it while mixing.
+
+  In adaptive mode (FRT_AUDIO_ADAPTIVE=1), the mixer checks every second
+  for underruns and for the jitter of the callback period: on underruns, the
+  ring buffer target grows by one period; after some time without underruns
+  and with a low jitter, it shrinks by one period.
+
+  Latencies are estimated from the average fill of the ring buffers: the
+  fill of the playback ring is sampled just after queuing a period (standing
+  in for the period being played), the capture ring just before draining it
+  (plus the period being recorded).
+ */
 class Audio {
 private:
+	static const int RING_PERIODS = 2;
+	static const int MIN_RING_PERIODS = 1;
+	static const int MAX_RING_PERIODS = 8;
+	static const Uint32 ADAPT_INTERVAL_MS = 1000;
+	static const int ADAPT_SHRINK_INTERVALS = 10;
+	static const int CAPTURE_RING_PERIODS = 4;
+	static const int CAPTURE_CHANNELS = 2;
+	static const int MAX_DEVICE_NAME = 256;
+	enum CaptureRequest {
+		CaptureNone,
+		CaptureStart,
+		CaptureStop
+	};
+	enum Ramp {
+		RampNone,
+		RampIn,
+		RampOut,
+		RampSilence
+	};
 	SampleProducer *producer_;
 	SDL_mutex *mutex_;
+	SDL_sem *wakeup_;
+	SDL_Thread *thread_;
+	SDL_atomic_t running_;
+	SDL_atomic_t switch_;
+	SDL_atomic_t underruns_;
+	SDL_atomic_t stalls_; // the device did not consume frames for two periods
+	SDL_atomic_t output_latency_us_;
+	RingBuffer ring_;
+	SampleConverter converter_;
+	SDL_AudioDeviceID device_;
+	char device_name_[MAX_DEVICE_NAME]; // empty: default, protected by mutex_
+	SDL_AudioSpec desired_;
 	int32_t *samples_;
-	int n_of_samples_;
+	uint8_t *buffer_;
+	int channels_;
+	int period_frames_;
+	int period_bytes_;
+	int target_bytes_;
+	int target_periods_;
+	Uint32 period_ms_;
+	bool adaptive_;
+	Uint32 next_adapt_;
+	int adapt_underruns_;
+	int adapt_stable_;
+	SDL_atomic_t target_periods_atomic_;
+	SDL_atomic_t jitter_us_;
+	Uint64 last_callback_;
+	int period_us_;
+	int mix_rate_;
+	float output_fill_;
+	SDL_atomic_t capture_request_;
+	SDL_atomic_t capture_overruns_;
+	SDL_atomic_t capture_latency_us_;
+	RingBuffer capture_ring_;
+	SDL_AudioDeviceID capture_device_;
+	char capture_device_name_[MAX_DEVICE_NAME]; // empty: default, protected by mutex_
+	int capture_period_frames_;
+	int capture_samples_;
+	int32_t *capture_buffer_;
+	float capture_fill_;
+	static int mixer_thread(void *data) {
+		Audio *audio = (Audio *)data;
+		audio->mix();
+		return 0;
+	}
+	void apply_ramp(Ramp ramp) {
+		const int n_of_samples = period_frames_ * channels_;
+		if (ramp == RampSilence) {
+			memset(samples_, 0, n_of_samples * sizeof(int32_t));
+			return;
+		}
+		const float step = 1.0f / period_frames_;
+		for (int i = 0; i < period_frames_; i++) {
+			float gain = ramp == RampIn ? i * step : 1.0f - i * step;
+			int32_t *frame = &samples_[i * channels_];
+			for (int j = 0; j < channels_; j++)
+				frame[j] = (int32_t)(frame[j] * gain);
+		}
+	}
+	void mix_period(Ramp ramp) {
+		if (ring_.space() < period_bytes_)
+			return;
+		if (ramp != RampSilence) {
+			SDL_LockMutex(mutex_);
+			if (capture_device_)
+				feed_captured_frames();
+			producer_->produce_samples(period_frames_, samples_);
+			SDL_UnlockMutex(mutex_);
+		}
+		if (ramp != RampNone)
+			apply_ramp(ramp);
+		if (converter_.is_passthrough()) {
+			ring_.write(samples_, period_bytes_);
+		} else {
+			converter_.convert(buffer_, samples_, period_frames_);
+			ring_.write(buffer_, period_bytes_);
+		}
+		const int frame_size = converter_.get_frame_size();
+		output_fill_ += 0.05f * ((float)ring_.available() / frame_size - output_fill_);
+		SDL_AtomicSet(&output_latency_us_, frames_to_us(output_fill_));
+	}
+	int frames_to_us(float n_of_frames) const {
+		return (int)(n_of_frames * 1000000.0f / mix_rate_);
+	}
+	void feed_captured_frames() {
+		const int frame_size = CAPTURE_CHANNELS * sizeof(int32_t);
+		int available = capture_ring_.available() / frame_size;
+		capture_fill_ += 0.05f * (available - capture_fill_);
+		SDL_AtomicSet(&capture_latency_us_, frames_to_us(capture_fill_ + capture_period_frames_));
+		const int max_frames = capture_samples_ / CAPTURE_CHANNELS;
+		while (available > 0) {
+			const int n = available < max_frames ? available : max_frames;
+			capture_ring_.read(capture_buffer_, n * frame_size);
+			producer_->consume_samples(n, capture_buffer_);
+			available -= n;
+		}
+	}
+	// mixer thread only
+	void open_capture() {
+		char name[MAX_DEVICE_NAME];
+		SDL_LockMutex(mutex_);
+		strcpy(name, capture_device_name_);
+		SDL_UnlockMutex(mutex_);
+		SDL_AudioSpec desired, obtained;
+		memset(&desired, 0, sizeof(desired));
+		desired.freq = mix_rate_;
+		desired.format = AUDIO_S32SYS;
+		desired.channels = CAPTURE_CHANNELS;
+		desired.samples = capture_period_frames_;
+		desired.callback = capture_callback;
+		desired.userdata = this;
+		capture_device_ = SDL_OpenAudioDevice(name[0] ? name : 0, 1, &desired, &obtained, 0);
+		if (!capture_device_) {
+			warn("SDL_OpenAudioDevice (capture) failed: %s.", SDL_GetError());
+			return;
+		}
+		SDL_LockMutex(mutex_);
+		capture_period_frames_ = obtained.samples;
+		SDL_UnlockMutex(mutex_);
+		const int frames = (capture_period_frames_ > period_frames_ ? capture_period_frames_ : period_frames_);
+		capture_ring_.init(CAPTURE_RING_PERIODS * frames * CAPTURE_CHANNELS * sizeof(int32_t));
+		capture_fill_ = 0.0f;
+		SDL_PauseAudioDevice(capture_device_, SDL_FALSE);
+	}
+	// mixer thread only
+	void close_capture() {
+		if (!capture_device_)
+			return;
+		SDL_PauseAudioDevice(capture_device_, SDL_TRUE);
+		SDL_CloseAudioDevice(capture_device_);
+		capture_device_ = 0;
+		SDL_AtomicSet(&capture_latency_us_, 0);
+	}
+	void handle_capture_request() {
+		switch (SDL_AtomicSet(&capture_request_, CaptureNone)) {
+		case CaptureStart:
+			close_capture();
+			open_capture();
+			break;
+		case CaptureStop:
+			close_capture();
+			break;
+		}
+	}
+	bool open_device(const char *name, SDL_AudioSpec &desired, SDL_AudioSpec &obtained, int allowed_changes) {
+		device_ = SDL_OpenAudioDevice(name, 0, &desired, &obtained, allowed_changes);
+		return device_ != 0;
+	}
+	bool open(const char *name) {
+		SDL_AudioSpec desired = desired_;
+		SDL_AudioSpec obtained;
+		const int allowed_changes = desired.format == AUDIO_S32SYS ? SDL_AUDIO_ALLOW_FORMAT_CHANGE : 0;
+		if (!open_device(name, desired, obtained, allowed_changes))
+			return false;
+		SampleFormat sample_format;
+		if (obtained.format == AUDIO_S32SYS) {
+			sample_format = SF_S32;
+		} else if (obtained.format == AUDIO_F32SYS) {
+			sample_format = SF_F32;
+		} else if (obtained.format == AUDIO_S16SYS) {
+			sample_format = SF_S16;
+		} else {
+			SDL_CloseAudioDevice(device_);
+			desired.format = AUDIO_S16SYS;
+			if (!open_device(name, desired, obtained, 0))
+				return false;
+			sample_format = SF_S16;
+		}
+		converter_.set_layout(sample_format, channels_, obtained.channels);
+		if (obtained.samples != period_frames_) {
+			period_frames_ = obtained.samples;
+			delete[] samples_;
+			samples_ = new int32_t[period_frames_ * channels_];
+		}
+		period_bytes_ = period_frames_ * converter_.get_frame_size();
+		period_ms_ = period_frames_ * 1000 / obtained.freq + 1;
+		period_us_ = frames_to_us(period_frames_);
+		target_bytes_ = target_periods_ * period_bytes_;
+		const int max_periods = adaptive_ ? MAX_RING_PERIODS : RING_PERIODS;
+		if (ring_.get_size() < (max_periods + 1) * period_bytes_)
+			ring_.init((max_periods + 1) * period_bytes_);
+		delete[] buffer_;
+		buffer_ = new uint8_t[period_bytes_];
+		return true;
+	}
+	void close() {
+		SDL_PauseAudioDevice(device_, SDL_TRUE);
+		SDL_CloseAudioDevice(device_);
+		device_ = 0;
+		// no more calls of the sdl2 callback after close
+		ring_.reset();
+		last_callback_ = 0;
+	}
+	// mixer thread only
+	void reopen() {
+		char name[MAX_DEVICE_NAME];
+		SDL_LockMutex(mutex_);
+		strcpy(name, device_name_);
+		SDL_UnlockMutex(mutex_);
+		const bool was_open = device_ != 0;
+		if (was_open)
+			close();
+		if (open(name[0] ? name : 0))
+			return;
+		if (was_open)
+			warn("SDL_OpenAudioDevice failed: %s.", SDL_GetError());
+		if (name[0] && open(0))
+			return;
+		SDL_Delay(500);
+	}
+	void set_target_periods(int periods) {
+		target_periods_ = periods;
+		target_bytes_ = periods * period_bytes_;
+		SDL_AtomicSet(&target_periods_atomic_, periods);
+	}
+	// mixer thread only
+	void adapt_latency() {
+		const Uint32 now = SDL_GetTicks();
+		if ((Sint32)(now - next_adapt_) < 0)
+			return;
+		next_adapt_ = now + ADAPT_INTERVAL_MS;
+		const int underruns = SDL_AtomicGet(&underruns_);
+		const int jitter_us = SDL_AtomicSet(&jitter_us_, 0);
+		if (underruns != adapt_underruns_) {
+			adapt_underruns_ = underruns;
+			adapt_stable_ = 0;
+			if (target_periods_ < MAX_RING_PERIODS)
+				set_target_periods(target_periods_ + 1);
+		} else if (jitter_us < period_us_ / 2) {
+			if (++adapt_stable_ >= ADAPT_SHRINK_INTERVALS && target_periods_ > MIN_RING_PERIODS) {
+				adapt_stable_ = 0;
+				set_target_periods(target_periods_ - 1);
+			}
+		} else {
+			adapt_stable_ = 0;
+		}
+	}
+	void wait_for_space() {
+		for (int i = 0; i < 2 * RING_PERIODS && ring_.space() < period_bytes_; i++)
+			SDL_SemWaitTimeout(wakeup_, 2 * period_ms_);
+	}
+	void drain() {
+		for (int i = 0; i < 2 * RING_PERIODS && ring_.available() > 0; i++)
+			SDL_SemWaitTimeout(wakeup_, 2 * period_ms_);
+	}
+	void mix() {
+		SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+		bool started = false;
+		Ramp ramp = RampNone;
+		while (SDL_AtomicGet(&running_)) {
+			if (SDL_AtomicGet(&capture_request_) != CaptureNone)
+				handle_capture_request();
+			if (SDL_AtomicCAS(&switch_, 1, 0)) {
+				if (started) {
+					wait_for_space();
+					mix_period(RampOut);
+					wait_for_space();
+					mix_period(RampSilence);
+					drain();
+				}
+				reopen();
+				started = false;
+				ramp = RampIn;
+				continue;
+			}
+			if (!device_) {
+				reopen();
+				continue;
+			}
+			if (ring_.available() + period_bytes_ > target_bytes_) {
+				if (!started) {
+					SDL_PauseAudioDevice(device_, SDL_FALSE);
+					started = true;
+				}
+				// the device is not consuming frames if the wait times out
+				if (SDL_SemWaitTimeout(wakeup_, 2 * period_ms_) == SDL_MUTEX_TIMEDOUT) {
+					SDL_AtomicAdd(&stalls_, 1);
+					if (SDL_GetAudioDeviceStatus(device_) == SDL_AUDIO_STOPPED) {
+						warn("audio device lost, reopening it");
+						reopen();
+						started = false;
+						ramp = RampIn;
+					}
+				}
+				continue;
+			}
+			mix_period(ramp);
+			ramp = RampNone;
+			if (adaptive_)
+				adapt_latency();
+		}
+	}
 public:
 	Audio(SampleProducer *producer) : producer_(producer) {
 		mutex_ = 0;
+		wakeup_ = 0;
+		thread_ = 0;
+		device_ = 0;
+		device_name_[0] = '\0';
+		samples_ = 0;
+		buffer_ = 0;
+		period_frames_ = 0;
+		output_fill_ = 0.0f;
+		target_periods_ = RING_PERIODS;
+		adaptive_ = false;
+		next_adapt_ = 0;
+		adapt_underruns_ = 0;
+		adapt_stable_ = 0;
+		last_callback_ = 0;
+		SDL_AtomicSet(&target_periods_atomic_, RING_PERIODS);
+		SDL_AtomicSet(&jitter_us_, 0);
+		capture_device_ = 0;
+		capture_device_name_[0] = '\0';
+		capture_buffer_ = 0;
+		capture_fill_ = 0.0f;
+		SDL_AtomicSet(&capture_request_, CaptureNone);
+		SDL_AtomicSet(&capture_overruns_, 0);
+		SDL_AtomicSet(&capture_latency_us_, 0);
+		SDL_AtomicSet(&output_latency_us_, 0);
+		SDL_AtomicSet(&running_, 0);
+		SDL_AtomicSet(&switch_, 0);
+		SDL_AtomicSet(&underruns_, 0);
+		SDL_AtomicSet(&stalls_, 0);
+	}
+	int get_default_channels() {
+		SDL_AudioSpec spec;
+		if (!SDL_GetDefaultAudioInfo || SDL_GetDefaultAudioInfo(0, &spec, 0))
+			return 2;
+		if (spec.channels >= 8)
+			return 8;
+		else if (spec.channels >= 6)
+			return 6;
+		return 2;
 	}
 	bool init(int mix_rate, int samples) {
-		SDL_AudioSpec desired, obtained;
-		memset(&desired, 0, sizeof(desired));
-		desired.freq = mix_rate;
-		desired.format = AUDIO_S16;
-		desired.channels = 2;
-		desired.samples = samples;
-		desired.callback = audio_callback;
-		desired.userdata = this;
-		if (SDL_OpenAudio(&desired, &obtained))
+		const SDL_AudioFormat format = parse_sample_format();
+		channels_ = parse_audio_channels();
+		if (!channels_)
+			channels_ = get_default_channels();
+		mix_rate_ = mix_rate;
+		adaptive_ = parse_env_bool("FRT_AUDIO_ADAPTIVE", false);
+		memset(&desired_, 0, sizeof(desired_));
+		desired_.freq = mix_rate;
+		desired_.format = format ? format : AUDIO_S32SYS;
+		desired_.channels = channels_ == 4 ? 6 : channels_;
+		desired_.samples = samples;
+		desired_.callback = audio_callback;
+		desired_.userdata = this;
+		if (!converter_.init(parse_sample_kernel(), parse_env_bool("FRT_AUDIO_DITHER", false)))
+			warn("FRT_AUDIO_KERNEL not available, using: scalar");
+		if (!open(0))
 			return false;
+		const int capture_latency = parse_env_int("FRT_AUDIO_CAPTURE_LATENCY", 0, 0, 1000);
+		capture_period_frames_ = samples;
+		if (capture_latency) {
+			capture_period_frames_ = 1;
+			while (capture_period_frames_ < capture_latency * mix_rate / 1000)
+				capture_period_frames_ <<= 1;
+		}
+		capture_samples_ = capture_period_frames_ * CAPTURE_CHANNELS;
+		capture_buffer_ = new int32_t[capture_samples_];
 		mutex_ = SDL_CreateMutex();
-		n_of_samples_ = obtained.channels * obtained.samples;
-		samples_ = new int32_t[n_of_samples_];
+		wakeup_ = SDL_CreateSemaphore(0);
 		return true;
 	}
+	int get_channels() const {
+		return channels_;
+	}
+	static int get_device_count(bool capture) {
+		return SDL_GetNumAudioDevices(capture ? 1 : 0);
+	}
+	static const char *get_device_name(int index, bool capture) {
+		return SDL_GetAudioDeviceName(index, capture ? 1 : 0);
+	}
+	// written by the mixer thread: call holding lock()
+	int get_capture_period() const {
+		return capture_period_frames_;
+	}
+	void start_capture() {
+		SDL_AtomicSet(&capture_request_, CaptureStart);
+		SDL_SemPost(wakeup_);
+	}
+	void stop_capture() {
+		SDL_AtomicSet(&capture_request_, CaptureStop);
+		SDL_SemPost(wakeup_);
+	}
+	// 0: default, takes effect at the next start_capture()
+	void set_capture_device(const char *name) {
+		SDL_LockMutex(mutex_);
+		if (!name)
+			name = "";
+		snprintf(capture_device_name_, sizeof(capture_device_name_), "%s", name);
+		SDL_UnlockMutex(mutex_);
+	}
+	// 0: default, used by start() if the mixer is not running yet
+	void set_device(const char *name) {
+		SDL_LockMutex(mutex_);
+		if (!name)
+			name = "";
+		snprintf(device_name_, sizeof(device_name_), "%s", name);
+		SDL_UnlockMutex(mutex_);
+		if (!SDL_AtomicGet(&running_))
+			return;
+		SDL_AtomicSet(&switch_, 1);
+		SDL_SemPost(wakeup_);
+	}
 	void start() {
-		SDL_PauseAudio(SDL_FALSE);
+		// init() opened the default device
+		if (device_name_[0])
+			SDL_AtomicSet(&switch_, 1);
+		SDL_AtomicSet(&running_, 1);
+		// the device is unpaused by the mixer thread, after the first period
+		thread_ = SDL_CreateThread(mixer_thread, "frt_mixer", this);
+		if (!thread_) {
+			warn("SDL_CreateThread failed: %s.", SDL_GetError());
+			SDL_AtomicSet(&running_, 0);
+		}
 	}
 	void lock() {
 		SDL_LockMutex(mutex_);
@@ -106,27 +958,78 @@ public:
 		SDL_UnlockMutex(mutex_);
 	}
 	void finish() {
-		SDL_PauseAudio(SDL_TRUE);
-		SDL_LockAudio();
-		// calling of sdl2 callback not expected after pause+lock
+		SDL_AtomicSet(&running_, 0);
+		if (thread_) {
+			SDL_SemPost(wakeup_);
+			SDL_WaitThread(thread_, 0);
+			thread_ = 0;
+		}
+		close_capture();
+		if (device_)
+			close();
+		SDL_DestroySemaphore(wakeup_);
+		wakeup_ = 0;
 		SDL_DestroyMutex(mutex_);
 		mutex_ = 0;
+		ring_.cleanup();
 		delete[] samples_;
 		samples_ = 0;
-		SDL_UnlockAudio();
-		SDL_CloseAudio();
+		delete[] buffer_;
+		buffer_ = 0;
+		capture_ring_.cleanup();
+		delete[] capture_buffer_;
+		capture_buffer_ = 0;
+	}
+	int get_underruns() {
+		return SDL_AtomicGet(&underruns_);
+	}
+	int get_stalls() {
+		return SDL_AtomicGet(&stalls_);
+	}
+	int get_capture_overruns() {
+		return SDL_AtomicGet(&capture_overruns_);
+	}
+	float get_output_latency() {
+		return SDL_AtomicGet(&output_latency_us_) / 1000000.0f;
+	}
+	// in periods, adaptive mode only changes it
+	int get_buffer_periods() {
+		return SDL_AtomicGet(&target_periods_atomic_);
+	}
+	// 0 if not capturing
+	float get_capture_latency() {
+		return SDL_AtomicGet(&capture_latency_us_) / 1000000.0f;
 	}
 	void fill_buffer(unsigned char *data, int length) {
-		int n_of_samples = length / sizeof(int16_t);
-		if (n_of_samples > n_of_samples_) // just in case, it shouldn't happen
-			n_of_samples = n_of_samples_;
-		const int channels = 2;
-		SDL_LockMutex(mutex_);
-		producer_->produce_samples(n_of_samples / channels, samples_);
-		SDL_UnlockMutex(mutex_);
-		int16_t *data16 = (int16_t *)data; // assume alignment is fine
-		for (int i = 0; i < n_of_samples; i++)
-			data16[i] = samples_[i] >> 16;
+		const uint64_t t0 = frame_trace ? FrameTrace::now() : 0;
+		if (adaptive_) {
+			const Uint64 now = SDL_GetPerformanceCounter();
+			if (last_callback_) {
+				int interval_us = (int)((now - last_callback_) * 1000000 / SDL_GetPerformanceFrequency());
+				int jitter_us = interval_us > period_us_ ? interval_us - period_us_ : period_us_ - interval_us;
+				if (jitter_us > SDL_AtomicGet(&jitter_us_))
+					SDL_AtomicSet(&jitter_us_, jitter_us);
+			}
+			last_callback_ = now;
+		}
+		int n = ring_.available();
+		if (n < length) {
+			SDL_AtomicAdd(&underruns_, 1);
+			memset(data + n, 0, length - n);
+		} else {
+			n = length;
+		}
+		ring_.read(data, n);
+		SDL_SemPost(wakeup_);
+		if (frame_trace)
+			frame_trace->add_async(FrameTrace::SpanAudio, t0);
+	}
+	void fill_capture_ring(const unsigned char *data, int length) {
+		if (capture_ring_.space() < length) {
+			SDL_AtomicAdd(&capture_overruns_, 1);
+			return;
+		}
+		capture_ring_.write(data, length);
 	}
 };
 
@@ -135,6 +1038,11 @@ void audio_callback(void *userdata, Uint8 *stream, int len) {
 	audio->fill_buffer(stream, len);
 }
 
+void capture_callback(void *userdata, Uint8 *stream, int len) {
+	Audio *audio = (Audio *)userdata;
+	audio->fill_capture_ring(stream, len);
+}
+
 struct ivec2 {
 	int x;
 	int y;
@@ -152,7 +1060,9 @@ enum MouseButton {
 	ButtonRight = 2,
 	ButtonMiddle = 3,
 	WheelUp = 4,
-	WheelDown = 5
+	WheelDown = 5,
+	WheelLeft = 6,
+	WheelRight = 7
 };
 
 enum MouseMode {
@@ -164,13 +1074,22 @@ enum MouseMode {
 struct EventHandler {
 	virtual ~EventHandler();
 	virtual void handle_resize_event(ivec2 size) = 0;
-	virtual void handle_key_event(int sdl2_code, int unicode, bool pressed) = 0;
+	virtual void handle_focus_event(bool focused) = 0;
+	virtual void handle_mouse_enter_event(bool entered) = 0;
+	virtual void handle_expose_event() = 0;
+	virtual void handle_key_event(int sdl2_code, int sdl2_scancode, int unicode, bool pressed, bool echo) = 0;
 	virtual void handle_mouse_motion_event(ivec2 pos, ivec2 dpos) = 0;
 	virtual void handle_mouse_button_event(int button, bool pressed, bool doubleclick) = 0;
+	virtual void handle_mouse_wheel_event(int button, float factor) = 0;
+	virtual void handle_touch_event(int index, bool pressed, ivec2 pos) = 0;
+	virtual void handle_touch_drag_event(int index, ivec2 pos, ivec2 dpos) = 0;
 	virtual void handle_js_status_event(int id, bool connected, const char *name, const char *guid) = 0;
 	virtual void handle_js_button_event(int id, int button, bool pressed) = 0;
 	virtual void handle_js_axis_event(int id, int axis, float value) = 0;
 	virtual void handle_js_hat_event(int id, int mask) = 0;
+	virtual void handle_js_pad_status_event(int id, const char *name, const char *guid) = 0;
+	virtual void handle_js_pad_button_event(int id, int sdl2_button, bool pressed) = 0;
+	virtual void handle_js_pad_axis_event(int id, int sdl2_axis, float value) = 0;
 	virtual void handle_js_vibra_event(int id, uint64_t timestamp) = 0;
 	virtual void handle_quit_event() = 0;
 	virtual void handle_flush_events() = 0;
@@ -192,48 +1111,447 @@ enum GraphicsAPI {
 	API_OpenGL_ES3
 };
 
-// TODO: factor out env vars parsing
+/*
+  Frame pacing.
 
-enum ExitShortcut {
-	ES_None,
-	ES_ShiftEnter,
-	ES_WinQ,
-	ES_Esc
+  The frame rate can be capped (FRT_FPS_CAP): the main loop sleeps until
+  shortly before the deadline, and then spins until the deadline.
+
+  Late input sampling (FRT_LATE_INPUT, in ms) delays the dispatching of events
+  until the given time before the next deadline, i.e. it should be a bit
+  more than the time needed to prepare a frame. Without a cap, the deadline
+  is the next vblank, assuming that swapping buffers waits for vsync.
+ */
+class FramePacer {
+private:
+	static const int SPIN_US = 2000;
+	Uint64 freq_;
+	Uint64 period_; // 0: no waiting
+	Uint64 margin_;
+	Uint64 deadline_;
+	bool capped_;
+	void wait_until(Uint64 t) {
+		Uint64 now = SDL_GetPerformanceCounter();
+		if (now >= t)
+			return;
+		const Uint64 spin = SPIN_US * freq_ / 1000000;
+		if (t - now > spin)
+			SDL_Delay((Uint32)((t - now - spin) * 1000 / freq_));
+		while (SDL_GetPerformanceCounter() < t)
+			;
+	}
+public:
+	FramePacer() : freq_(1), period_(0), margin_(0), deadline_(0), capped_(false) {
+	}
+	// refresh_rate: 0 if not synced to vblank
+	void init(float refresh_rate) {
+		const int fps_cap = parse_env_int("FRT_FPS_CAP", 0, 0, 1000);
+		const int late_input_ms = parse_env_int("FRT_LATE_INPUT", 0, 0, 100);
+		freq_ = SDL_GetPerformanceFrequency();
+		capped_ = fps_cap > 0;
+		if (capped_)
+			period_ = freq_ / fps_cap;
+		else if (late_input_ms && refresh_rate > 0.0f)
+			period_ = (Uint64)(freq_ / refresh_rate);
+		else
+			period_ = 0;
+		margin_ = late_input_ms * freq_ / 1000;
+		if (margin_ >= period_)
+			margin_ = 0;
+		deadline_ = SDL_GetPerformanceCounter();
+	}
+	// before dispatching events
+	void wait() {
+		if (period_)
+			wait_until(deadline_ - margin_);
+	}
+	// after the frame has been submitted
+	void frame_done() {
+		if (!period_)
+			return;
+		const Uint64 now = SDL_GetPerformanceCounter();
+		if (!capped_) {
+			deadline_ = now + period_;
+			return;
+		}
+		deadline_ += period_;
+		if (deadline_ + period_ < now) // too late, start again
+			deadline_ = now;
+	}
 };
 
-ExitShortcut parse_exit_shortcut() {
-	const char *s = getenv("FRT_EXIT_SHORTCUT");
-	if (!s || !strcmp(s, "none"))
-		return ES_None;
-	else if (!strcmp(s, "shift-enter"))
-		return ES_ShiftEnter;
-	else if (!strcmp(s, "win-q"))
-		return ES_WinQ;
-	else if (!strcmp(s, "esc"))
-		return ES_Esc;
-	warn("invalid FRT_EXIT_SHORTCUT (%s), using: esc", s);
-	return ES_Esc;
-}
+/*
+  Bounded lock-free multi-producer single-consumer queue (each cell has a
+  sequence number telling whether it is free for the producer claiming it,
+  or ready for the consumer). As in RingBuffer, barriers make sure a cell's
+  data is complete before its sequence number is published.
+ */
+template <typename T, int SIZE>
+class EventQueue {
+private:
+	static_assert((SIZE & (SIZE - 1)) == 0, "size must be a power of 2");
+	struct Cell {
+		SDL_atomic_t seq;
+		T data;
+	};
+	Cell cells_[SIZE];
+	SDL_atomic_t tail_;
+	int head_;
+	static int diff(int a, int b) {
+		return (int)((unsigned)a - (unsigned)b);
+	}
+public:
+	EventQueue() : head_(0) {
+		for (int i = 0; i < SIZE; i++)
+			SDL_AtomicSet(&cells_[i].seq, i);
+		SDL_AtomicSet(&tail_, 0);
+	}
+	// any thread, false if full
+	bool push(const T &data) {
+		Cell *cell;
+		int pos = SDL_AtomicGet(&tail_);
+		for (;;) {
+			cell = &cells_[pos & (SIZE - 1)];
+			const int d = diff(SDL_AtomicGet(&cell->seq), pos);
+			if (d == 0 && SDL_AtomicCAS(&tail_, pos, pos + 1))
+				break;
+			else if (d < 0)
+				return false;
+			pos = SDL_AtomicGet(&tail_);
+		}
+		cell->data = data;
+		SDL_MemoryBarrierRelease();
+		SDL_AtomicSet(&cell->seq, pos + 1);
+		return true;
+	}
+	// consumer thread, false if empty
+	bool pop(T &data) {
+		Cell *cell = &cells_[head_ & (SIZE - 1)];
+		if (diff(SDL_AtomicGet(&cell->seq), head_ + 1) < 0)
+			return false;
+		SDL_MemoryBarrierAcquire();
+		data = cell->data;
+		SDL_MemoryBarrierRelease();
+		SDL_AtomicSet(&cell->seq, head_ + SIZE);
+		head_++;
+		return true;
+	}
+};
+
+/*
+  Maps ids (SDL finger and joystick instance ids) to the lowest free slot,
+  which is what Godot expects for touch and joypad indices, through a small
+  open addressing hash table, rebuilt when a slot is released.
+ */
+template <typename Id, int N_OF_SLOTS>
+class SlotTable {
+private:
+	static const int HASH_SIZE = 32; // power of 2
+	static_assert(N_OF_SLOTS <= HASH_SIZE / 2, "hash table too small");
+	Id id_[N_OF_SLOTS];
+	uint32_t used_;
+	int8_t hash_[HASH_SIZE]; // -1: empty
+	static int bucket(Id id) {
+		return (int)(((uint32_t)id * 2654435761u) & (HASH_SIZE - 1));
+	}
+	void insert(int slot) {
+		int h = bucket(id_[slot]);
+		while (hash_[h] >= 0)
+			h = (h + 1) & (HASH_SIZE - 1);
+		hash_[h] = slot;
+	}
+public:
+	SlotTable() {
+		clear();
+	}
+	void clear() {
+		used_ = 0;
+		memset(hash_, -1, sizeof(hash_));
+	}
+	// -1: not found
+	int find(Id id) const {
+		for (int h = bucket(id);; h = (h + 1) & (HASH_SIZE - 1)) {
+			const int slot = hash_[h];
+			if (slot < 0 || id_[slot] == id)
+				return slot;
+		}
+	}
+	// -1: full
+	int add(Id id) {
+		int slot = 0;
+		while (slot < N_OF_SLOTS && (used_ & (1 << slot)))
+			slot++;
+		if (slot == N_OF_SLOTS)
+			return -1;
+		used_ |= (1 << slot);
+		id_[slot] = id;
+		insert(slot);
+		return slot;
+	}
+	void remove(int slot) {
+		used_ &= ~(1 << slot);
+		memset(hash_, -1, sizeof(hash_));
+		for (int i = 0; i < N_OF_SLOTS; i++)
+			if (used_ & (1 << i))
+				insert(i);
+	}
+};
 
 class OS_FRT {
 private:
 	static const int MAX_JOYSTICKS = 16;
-	static const int REQUEST_UNICODE = -1;
+	static const int MAX_PENDING_KEYS = 16;
 	SDL_Window *window_;
 	SDL_GLContext context_;
 	EventHandler *handler_;
 	InputModifierState st_;
 	MouseMode mouse_mode_;
-	SDL_KeyboardEvent key_ev_;
-	int key_unicode_;
+	MouseMotionPolicy mouse_motion_;
+	bool motion_pending_;
+	ivec2 motion_pos_;
+	ivec2 motion_rel_;
+	bool precise_wheel_;
+	float wheel_x_;
+	float wheel_y_;
+	static const int MAX_FINGERS = 10;
+	bool touch_;
+	SlotTable<SDL_FingerID, MAX_FINGERS> fingers_;
+	struct PendingKey {
+		SDL_Scancode scancode;
+		int sdl2_code;
+		bool echo;
+	};
+	PendingKey pending_keys_[MAX_PENDING_KEYS];
+	int n_pending_keys_;
+	int key_unicode_[SDL_NUM_SCANCODES]; // of pressed keys, sent on release
+	JoystickBackend js_backend_;
+	SlotTable<SDL_JoystickID, MAX_JOYSTICKS> js_slots_;
 	SDL_Joystick *js_[MAX_JOYSTICKS];
+	SDL_GameController *gc_[MAX_JOYSTICKS]; // 0: raw joystick
 	uint64_t rumble_timestamp_[MAX_JOYSTICKS];
 	uint32_t rumble_supported_;
+	SDL_atomic_t rumble_requested_; // mask of ids
+	static const int MAX_AXES = 16;
+	struct AxisFilter {
+		float deadzone;
+		float epsilon;
+		float sent[MAX_AXES];
+		float pending[MAX_AXES];
+		uint32_t pending_mask;
+	};
+	AxisFilter axis_filter_[MAX_JOYSTICKS];
+	int axis_events_dropped_;
 	ExitShortcut exit_shortcut_;
-	void resize_event(const SDL_Event &ev) {
+	SDL_atomic_t swap_interval_;
+	int current_swap_interval_;
+	bool adaptive_vsync_;
+	int idle_wait_ms_; // 0: disabled
+	/*
+	  Exclusive fullscreen (FRT_FULLSCREEN=exclusive) switches the display
+	  to the mode closest to the requested size (the window size if none)
+	  and to FRT_FULLSCREEN_REFRESH (0: current refresh rate), e.g. to let a
+	  weak GPU drive a 4K TV at 1080p or 720p.
+	 */
+	FullscreenMode fullscreen_mode_;
+	ivec2 fullscreen_size_; // 0x0: window size
+	int fullscreen_refresh_rate_;
+	/*
+	  Display information is cached, and refreshed on SDL_DISPLAYEVENT
+	  (SDL >= 2.0.9) and when changing the display mode, which SDL doesn't
+	  report. The display of the window is updated when it moves.
+	 */
+	static const int MAX_DISPLAYS = 8;
+	struct DisplayInfo {
+		ivec2 pos;
 		ivec2 size;
-		SDL_GL_GetDrawableSize(window_, &size.x, &size.y);
-		handler_->handle_resize_event(size);
+		float refresh_rate;
+		int dpi;
+	};
+	DisplayInfo displays_[MAX_DISPLAYS];
+	int n_displays_;
+	int display_; // of the window
+	/*
+	  Window flags are cached, as Godot queries some of them every frame:
+	  they are refreshed on SDL_WINDOWEVENT, and after changing them.
+	  With FRT_DRAW_UNFOCUSED=no, nothing is drawn while the window has no
+	  input focus (minimized or hidden windows are never drawn).
+	 */
+	Uint32 window_flags_;
+	bool draw_unfocused_;
+	void update_window_flags() {
+		window_flags_ = SDL_GetWindowFlags(window_);
+	}
+	void window_event(const SDL_WindowEvent &ev) {
+		update_window_flags();
+		switch (ev.event) {
+		case SDL_WINDOWEVENT_SIZE_CHANGED:
+			handler_->handle_resize_event(get_drawable_size());
+			break;
+		case SDL_WINDOWEVENT_MOVED:
+			update_window_display();
+			break;
+		case SDL_WINDOWEVENT_SHOWN:
+		case SDL_WINDOWEVENT_EXPOSED:
+		case SDL_WINDOWEVENT_RESTORED:
+			handler_->handle_expose_event();
+			break;
+		case SDL_WINDOWEVENT_FOCUS_GAINED:
+			handler_->handle_focus_event(true);
+			break;
+		case SDL_WINDOWEVENT_FOCUS_LOST:
+			handler_->handle_focus_event(false);
+			break;
+		case SDL_WINDOWEVENT_ENTER:
+			handler_->handle_mouse_enter_event(true);
+			break;
+		case SDL_WINDOWEVENT_LEAVE:
+			handler_->handle_mouse_enter_event(false);
+			break;
+		}
+	}
+	void update_window_display() {
+		const int display = SDL_GetWindowDisplayIndex(window_);
+		display_ = display >= 0 && display < n_displays_ ? display : 0;
+	}
+	void update_displays() {
+		n_displays_ = SDL_GetNumVideoDisplays();
+		if (n_displays_ > MAX_DISPLAYS)
+			n_displays_ = MAX_DISPLAYS;
+		else if (n_displays_ < 1)
+			n_displays_ = 1;
+		for (int i = 0; i < n_displays_; i++) {
+			DisplayInfo &info = displays_[i];
+			SDL_Rect bounds;
+			if (SDL_GetDisplayBounds(i, &bounds)) {
+				info.pos.x = 0;
+				info.pos.y = 0;
+			} else {
+				info.pos.x = bounds.x;
+				info.pos.y = bounds.y;
+			}
+			SDL_DisplayMode mode;
+			if (SDL_GetCurrentDisplayMode(i, &mode)) {
+				info.size.x = 1280;
+				info.size.y = 720;
+				info.refresh_rate = 60.0f;
+			} else {
+				info.size.x = mode.w;
+				info.size.y = mode.h;
+				info.refresh_rate = mode.refresh_rate ? (float)mode.refresh_rate : 60.0f;
+			}
+			float dpi;
+			info.dpi = SDL_GetDisplayDPI(i, &dpi, 0, 0) ? 72 : (int)dpi;
+		}
+		update_window_display();
+	}
+	// -1 or out of range: the display of the window
+	int to_display(int screen) const {
+		return screen >= 0 && screen < n_displays_ ? screen : display_;
+	}
+	const DisplayInfo &get_display_info(int screen) const {
+		return displays_[to_display(screen)];
+	}
+	bool apply_fullscreen_mode() {
+		SDL_DisplayMode desired, mode;
+		SDL_zero(desired);
+		desired.w = fullscreen_size_.x ? fullscreen_size_.x : get_size().x;
+		desired.h = fullscreen_size_.y ? fullscreen_size_.y : get_size().y;
+		desired.refresh_rate = fullscreen_refresh_rate_;
+		if (!SDL_GetClosestDisplayMode(get_display(), &desired, &mode)) {
+			warn("no display mode for %dx%d@%d: %s", desired.w, desired.h, desired.refresh_rate, SDL_GetError());
+			return false;
+		}
+		if (SDL_SetWindowDisplayMode(window_, &mode) < 0) {
+			warn("SDL_SetWindowDisplayMode failed: %s.", SDL_GetError());
+			return false;
+		}
+		update_displays();
+		return true;
+	}
+	struct TimedEvent {
+		SDL_Event ev;
+		uint64_t time;
+	};
+	typedef EventQueue<TimedEvent, 1024> InputQueue;
+	InputQueue *input_queue_;
+	SDL_Thread *input_thread_;
+	SDL_atomic_t input_running_;
+	SDL_atomic_t input_queue_overflows_;
+	uint64_t event_time_; // 0: unknown
+	/*
+	  Timestamped input (FRT_INPUT_THREAD).
+
+	  SDL only allows pumping video (keyboard, mouse, touch) events from
+	  the main thread, so those are still read when dispatch_events is
+	  called. Joysticks, instead, are polled by a separate thread, at about
+	  1 kHz (SDL >= 2.0.7 is needed to do so safely).
+	  Input events are copied by an event watch, in the thread generating
+	  them, and queued with the time they were generated. The watch is
+	  called before the event is added to the SDL queue, so the copies left
+	  there can be skipped by dispatch_events. Events are lost if the queue
+	  is full.
+	 */
+	// keyboard, mouse, joystick, game controller and touch events
+	static bool is_input_event(Uint32 type) {
+		return type >= SDL_KEYDOWN && type < SDL_CLIPBOARDUPDATE;
+	}
+	static int input_watch(void *data, SDL_Event *ev) {
+		OS_FRT *os = (OS_FRT *)data;
+		if (!is_input_event(ev->type))
+			return 0;
+		TimedEvent tev;
+		tev.ev = *ev;
+		tev.time = SDL_GetPerformanceCounter();
+		if (!os->input_queue_->push(tev))
+			SDL_AtomicAdd(&os->input_queue_overflows_, 1);
+		return 0;
+	}
+	static int input_thread(void *data) {
+		OS_FRT *os = (OS_FRT *)data;
+		while (SDL_AtomicGet(&os->input_running_)) {
+			SDL_JoystickUpdate();
+			SDL_Delay(1);
+		}
+		return 0;
+	}
+	void init_input_thread(const SDL_version &version) {
+		if (!parse_env_bool("FRT_INPUT_THREAD", false))
+			return;
+		input_queue_ = new InputQueue();
+		SDL_AddEventWatch(input_watch, this);
+		if (SDL_VERSIONNUM(version.major, version.minor, version.patch) < SDL_VERSIONNUM(2, 0, 7)) {
+			warn("SDL >= 2.0.7 needed to poll joysticks in a separate thread");
+			return;
+		}
+		SDL_AtomicSet(&input_running_, 1);
+		if (!(input_thread_ = SDL_CreateThread(input_thread, "frt_input", this))) {
+			warn("SDL_CreateThread failed: %s.", SDL_GetError());
+			SDL_AtomicSet(&input_running_, 0);
+		}
+	}
+	void cleanup_input_thread() {
+		if (input_thread_) {
+			SDL_AtomicSet(&input_running_, 0);
+			SDL_WaitThread(input_thread_, 0);
+			input_thread_ = 0;
+		}
+		if (input_queue_) {
+			SDL_DelEventWatch(input_watch, this);
+			delete input_queue_;
+			input_queue_ = 0;
+		}
+	}
+	int utf8_length(const char *s) {
+		if ((s[0] & 0x80) == 0)
+			return 1;
+		else if ((s[0] & 0xe0) == 0xc0)
+			return 2;
+		else if ((s[0] & 0xf0) == 0xe0)
+			return 3;
+		else if ((s[0] & 0xf8) == 0xf0)
+			return 4;
+		else
+			return 1;
 	}
 	int utf8_to_unicode(const char *s) {
 		if ((s[0] & 0x80) == 0)
@@ -242,15 +1560,33 @@ private:
 			return ((s[0] & 0x1f) << 6) | (s[1] & 0x3f);
 		else if ((s[0] & 0xf0) == 0xe0)
 			return ((s[0] & 0x0f) << 12) | ((s[1] & 0x3f) << 6) | (s[2] & 0x3f);
+		else if ((s[0] & 0xf8) == 0xf0)
+			return ((s[0] & 0x07) << 18) | ((s[1] & 0x3f) << 12) | ((s[2] & 0x3f) << 6) | (s[3] & 0x3f);
 		else
 			return 0;
 	}
+	void send_pending_key(int unicode) {
+		const PendingKey key = pending_keys_[0];
+		n_pending_keys_--;
+		memmove(&pending_keys_[0], &pending_keys_[1], n_pending_keys_ * sizeof(PendingKey));
+		key_unicode_[key.scancode] = unicode;
+		handler_->handle_key_event(key.sdl2_code, key.scancode, unicode, true, key.echo);
+	}
+	void flush_pending_keys(int n) {
+		while (n-- > 0)
+			send_pending_key(0);
+	}
 	void text_event(const SDL_TextInputEvent &text) {
-		if (key_unicode_ != REQUEST_UNICODE)
-			return;
-		key_unicode_ = utf8_to_unicode(text.text);
-		int sdl2_code = key_ev_.keysym.sym;
-		handler_->handle_key_event(sdl2_code, key_unicode_, true);
+		for (const char *s = text.text; *s; s += utf8_length(s)) {
+			int unicode = utf8_to_unicode(s);
+			if (n_pending_keys_ > 0) {
+				send_pending_key(unicode);
+			} else {
+				// no key to attach it to (e.g. input methods): press and release
+				handler_->handle_key_event(0, 0, unicode, true, false);
+				handler_->handle_key_event(0, 0, unicode, false, false);
+			}
+		}
 	}
 	bool require_unicode(int c) {
 		return (c >= 0x20 && c < 0x80) || (c >= 0xa0 && c < 0xff);
@@ -282,31 +1618,94 @@ private:
 				return;
 			}
 		}
-		if (pressed && !key.repeat && require_unicode(sdl2_code)) {
-			key_ev_ = key;
-			key_unicode_ = REQUEST_UNICODE;
+		const SDL_Scancode scancode = key.keysym.scancode;
+		if (pressed && require_unicode(sdl2_code)) {
+			if (n_pending_keys_ == MAX_PENDING_KEYS)
+				flush_pending_keys(1);
+			PendingKey &pending = pending_keys_[n_pending_keys_++];
+			pending.scancode = scancode;
+			pending.sdl2_code = sdl2_code;
+			pending.echo = key.repeat;
 			return;
 		}
-		handler_->handle_key_event(sdl2_code, key_unicode_, pressed);
-		if (!pressed)
-			key_unicode_ = 0;
+		int unicode = 0;
+		if (!pressed) {
+			for (int i = 0; i < n_pending_keys_; i++) {
+				if (pending_keys_[i].scancode == scancode) {
+					flush_pending_keys(i + 1);
+					break;
+				}
+			}
+			unicode = key_unicode_[scancode];
+			key_unicode_[scancode] = 0;
+		}
+		handler_->handle_key_event(sdl2_code, scancode, unicode, pressed, key.repeat);
+	}
+	/*
+	  With MM_Coalesce, motion events are merged until the end of the frame,
+	  or until a button or wheel event needs the current position.
+	 */
+	void flush_mouse_motion() {
+		if (!motion_pending_)
+			return;
+		motion_pending_ = false;
+		handler_->handle_mouse_motion_event(motion_pos_, motion_rel_);
+	}
+	/*
+	  Wheel events are merged until the end of the frame, or until a motion
+	  or button event, and sent as a single press/release pair per direction,
+	  with the accumulated amount as factor. So, at most one of motion and
+	  wheel is pending, and events keep their order and position.
+	 */
+	void flush_mouse_wheel() {
+		if (wheel_y_ != 0.0f)
+			handler_->handle_mouse_wheel_event(wheel_y_ > 0.0f ? WheelUp : WheelDown, wheel_y_ > 0.0f ? wheel_y_ : -wheel_y_);
+		if (wheel_x_ != 0.0f)
+			handler_->handle_mouse_wheel_event(wheel_x_ > 0.0f ? WheelRight : WheelLeft, wheel_x_ > 0.0f ? wheel_x_ : -wheel_x_);
+		wheel_x_ = 0.0f;
+		wheel_y_ = 0.0f;
 	}
 	void mouse_event(const SDL_Event &ev) {
 		int os_button;
+		// with native touch events, Godot emulates the mouse by itself
+		if (touch_ && ev.type != SDL_MOUSEWHEEL && (ev.type == SDL_MOUSEMOTION ? ev.motion.which : ev.button.which) == SDL_TOUCH_MOUSEID)
+			return;
 		if (ev.type == SDL_MOUSEMOTION) {
+			flush_mouse_wheel();
 			ivec2 pos = { ev.motion.x, ev.motion.y };
 			ivec2 dpos = { ev.motion.xrel, ev.motion.yrel };
-			handler_->handle_mouse_motion_event(pos, dpos);
-		} else if (ev.type == SDL_MOUSEWHEEL) {
-			if (ev.wheel.y > 0)
-				os_button = WheelUp;
-			else if (ev.wheel.y < 0)
-				os_button = WheelDown;
-			else
+			if (mouse_motion_ == MM_Raw) {
+				handler_->handle_mouse_motion_event(pos, dpos);
 				return;
-			handler_->handle_mouse_button_event(os_button, true, false);
-			handler_->handle_mouse_button_event(os_button, false, false);
+			}
+			if (motion_pending_) {
+				motion_rel_.x += dpos.x;
+				motion_rel_.y += dpos.y;
+			} else {
+				motion_rel_ = dpos;
+				motion_pending_ = true;
+			}
+			motion_pos_ = pos;
+			return;
+		}
+		flush_mouse_motion();
+		if (ev.type == SDL_MOUSEWHEEL) {
+			float x = ev.wheel.x;
+			float y = ev.wheel.y;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+			if (precise_wheel_) {
+				x = ev.wheel.preciseX;
+				y = ev.wheel.preciseY;
+			}
+#endif
+			if (ev.wheel.direction == SDL_MOUSEWHEEL_FLIPPED) {
+				x = -x;
+				y = -y;
+			}
+			wheel_x_ += x;
+			wheel_y_ += y;
 		} else { // SDL_MOUSEBUTTONUP, SDL_MOUSEBUTTONDOWN
+			flush_mouse_wheel();
 			switch (ev.button.button) {
 			case SDL_BUTTON_LEFT:
 				os_button = ButtonLeft;
@@ -323,12 +1722,144 @@ private:
 			handler_->handle_mouse_button_event(os_button, ev.button.state == SDL_PRESSED, ev.button.clicks > 1);
 		}
 	}
-	int get_js_id(int inst_id) {
-		SDL_Joystick *js = SDL_JoystickFromInstanceID(inst_id);
-		for (int id = 0; id < MAX_JOYSTICKS; id++)
-			if (js_[id] == js)
-				return id;
-		return -1;
+	void touch_event(const SDL_TouchFingerEvent &ev) {
+		int index = fingers_.find(ev.fingerId);
+		if (ev.type == SDL_FINGERDOWN && index < 0)
+			index = fingers_.add(ev.fingerId);
+		if (index < 0)
+			return;
+		ivec2 size;
+		SDL_GL_GetDrawableSize(window_, &size.x, &size.y);
+		ivec2 pos = { (int)(ev.x * size.x), (int)(ev.y * size.y) };
+		switch (ev.type) {
+		case SDL_FINGERDOWN:
+			handler_->handle_touch_event(index, true, pos);
+			break;
+		case SDL_FINGERUP:
+			fingers_.remove(index);
+			handler_->handle_touch_event(index, false, pos);
+			break;
+		case SDL_FINGERMOTION: {
+			ivec2 dpos = { (int)(ev.dx * size.x), (int)(ev.dy * size.y) };
+			handler_->handle_touch_drag_event(index, pos, dpos);
+			} break;
+		}
+	}
+	// raw joystick events of game controllers are ignored
+	int get_js_id(SDL_JoystickID inst_id) {
+		const int id = js_slots_.find(inst_id);
+		return id >= 0 && !gc_[id] ? id : -1;
+	}
+	int get_gc_id(SDL_JoystickID inst_id) {
+		const int id = js_slots_.find(inst_id);
+		return id >= 0 && gc_[id] ? id : -1;
+	}
+	/*
+	  Joysticks are assigned the first free id, independently of their
+	  device index, which changes when other devices are removed.
+	  Both report their SDL GUID, but game controllers are announced with
+	  handle_js_pad_status_event, as their events are already mapped by SDL.
+	 */
+	void js_added(int index) {
+		SDL_GameController *gc = 0;
+		SDL_Joystick *js;
+		if (js_backend_ == JB_GameController && SDL_IsGameController(index)) {
+			if (!(gc = SDL_GameControllerOpen(index)))
+				return;
+			js = SDL_GameControllerGetJoystick(gc);
+		} else if (!(js = SDL_JoystickOpen(index))) {
+			return;
+		}
+		const SDL_JoystickID inst_id = SDL_JoystickInstanceID(js);
+		int id = -1;
+		if (js_slots_.find(inst_id) >= 0 || (id = js_slots_.add(inst_id)) < 0) {
+			if (gc)
+				SDL_GameControllerClose(gc);
+			else
+				SDL_JoystickClose(js);
+			return;
+		}
+		js_[id] = js;
+		gc_[id] = gc;
+		memset(axis_filter_[id].sent, 0, sizeof(axis_filter_[id].sent));
+		axis_filter_[id].pending_mask = 0;
+		rumble_timestamp_[id] = 0;
+		if (SDL_JoystickRumble)
+			rumble_supported_ |= (1 << id);
+		char guid[64];
+		SDL_JoystickGetGUIDString(SDL_JoystickGetDeviceGUID(index), guid, sizeof(guid));
+		if (gc) {
+			const char *name = SDL_GameControllerNameForIndex(index);
+			handler_->handle_js_pad_status_event(id, name ? name : "", guid);
+		} else {
+			const char *name = SDL_JoystickNameForIndex(index);
+			handler_->handle_js_status_event(id, true, name ? name : "", guid);
+		}
+	}
+	/*
+	  Axis values are filtered by a deadzone (rescaled to keep the full
+	  range) and only the latest value of each axis in a frame is sent, if
+	  it differs by at least epsilon from the last one sent (returning to
+	  rest or reaching full range is always sent). SDL axes go from -32768
+	  to 32767, so positive full deflection is clamped to 1.0 first.
+	 */
+	void axis_event(int id, int axis, float value) {
+		if (axis >= MAX_AXES) {
+			send_axis_event(id, axis, value);
+			return;
+		}
+		AxisFilter &f = axis_filter_[id];
+		if (value >= 32767.0f / 32768.0f)
+			value = 1.0f;
+		const float magnitude = value < 0.0f ? -value : value;
+		if (magnitude <= f.deadzone)
+			value = 0.0f;
+		else if (f.deadzone > 0.0f)
+			value = (value < 0.0f ? value + f.deadzone : value - f.deadzone) / (1.0f - f.deadzone);
+		if (f.pending_mask & (1 << axis))
+			axis_events_dropped_++;
+		f.pending[axis] = value;
+		f.pending_mask |= (1 << axis);
+	}
+	void send_axis_event(int id, int axis, float value) {
+		if (gc_[id])
+			handler_->handle_js_pad_axis_event(id, axis, value);
+		else
+			handler_->handle_js_axis_event(id, axis, value);
+	}
+	void flush_axis_events() {
+		for (int id = 0; id < MAX_JOYSTICKS; id++) {
+			AxisFilter &f = axis_filter_[id];
+			for (int axis = 0; f.pending_mask; axis++) {
+				if (!(f.pending_mask & (1 << axis)))
+					continue;
+				f.pending_mask &= ~(1 << axis);
+				const float value = f.pending[axis];
+				const float delta = value - f.sent[axis];
+				const bool edge = value == 0.0f || value <= -1.0f || value >= 1.0f;
+				if (delta == 0.0f || (!edge && delta < f.epsilon && delta > -f.epsilon)) {
+					axis_events_dropped_++;
+					continue;
+				}
+				f.sent[axis] = value;
+				send_axis_event(id, axis, value);
+			}
+		}
+	}
+	void js_removed(SDL_JoystickID inst_id) {
+		const int id = js_slots_.find(inst_id);
+		if (id < 0)
+			return;
+		if (gc_[id])
+			SDL_GameControllerClose(gc_[id]);
+		else
+			SDL_JoystickClose(js_[id]);
+		js_[id] = 0;
+		gc_[id] = 0;
+		axis_filter_[id].pending_mask = 0;
+		rumble_supported_ &= ~(1 << id);
+		js_slots_.remove(id);
+		handler_->handle_js_status_event(id, false, "", "");
 	}
 	void js_event(const SDL_Event &ev) {
 		int id;
@@ -336,9 +1867,8 @@ private:
 		case SDL_JOYAXISMOTION: {
 			if ((id = get_js_id(ev.jaxis.which)) < 0)
 				return;
-			int axis = ev.jaxis.axis;
 			float value = (float)ev.jaxis.value / 32768.0f;
-			handler_->handle_js_axis_event(id, axis, value);
+			axis_event(id, ev.jaxis.axis, value);
 			} break;
 		case SDL_JOYHATMOTION: {
 			if ((id = get_js_id(ev.jhat.which)) < 0)
@@ -382,50 +1912,112 @@ private:
 			bool pressed = ev.jbutton.state == SDL_PRESSED;
 			handler_->handle_js_button_event(id, button, pressed);
 			} break;
-		case SDL_JOYDEVICEADDED: {
-			id = ev.jdevice.which;
-			if (id >= MAX_JOYSTICKS)
+		case SDL_JOYDEVICEADDED:
+			js_added(ev.jdevice.which);
+			break;
+		case SDL_JOYDEVICEREMOVED:
+			js_removed(ev.jdevice.which);
+			break;
+		case SDL_CONTROLLERAXISMOTION: {
+			if ((id = get_gc_id(ev.caxis.which)) < 0)
 				return;
-			const char *name = SDL_JoystickNameForIndex(id);
-			char guid[64];
-			SDL_JoystickGetGUIDString(SDL_JoystickGetDeviceGUID(id), guid, sizeof(guid));
-			handler_->handle_js_status_event(id, true, name, guid);
-			js_[id] = SDL_JoystickOpen(id);
-			rumble_timestamp_[id] = 0;
-			if (SDL_JoystickRumble)
-				rumble_supported_ |= (1 << id);
+			float value = (float)ev.caxis.value / 32768.0f;
+			axis_event(id, ev.caxis.axis, value);
 			} break;
-		case SDL_JOYDEVICEREMOVED: {
-			if ((id = get_js_id(ev.jdevice.which)) < 0)
+		case SDL_CONTROLLERBUTTONDOWN:
+		case SDL_CONTROLLERBUTTONUP: {
+			if ((id = get_gc_id(ev.cbutton.which)) < 0)
 				return;
-			SDL_JoystickClose(js_[id]);
-			js_[id] = 0;
-			handler_->handle_js_status_event(id, false, "", "");
+			bool pressed = ev.cbutton.state == SDL_PRESSED;
+			handler_->handle_js_pad_button_event(id, ev.cbutton.button, pressed);
 			} break;
 		}
 	}
+	// only for the ids with a pending request, so idle frames do no work
 	void vibra_events() {
-		for (int id = 0; id < MAX_JOYSTICKS; id++)
-			if (js_[id] && (rumble_supported_ & (1 << id)))
+		uint32_t requested = (uint32_t)SDL_AtomicSet(&rumble_requested_, 0) & rumble_supported_;
+		for (int id = 0; requested; id++, requested >>= 1)
+			if ((requested & 1) && js_[id])
 				handler_->handle_js_vibra_event(id, rumble_timestamp_[id]);
 	}
 public:
 	OS_FRT(EventHandler *handler) : handler_(handler) {
 		mouse_mode_ = MouseVisible;
-		key_unicode_ = 0;
+		mouse_motion_ = parse_mouse_motion();
+		motion_pending_ = false;
+		precise_wheel_ = false;
+		wheel_x_ = 0.0f;
+		wheel_y_ = 0.0f;
+		touch_ = parse_env_bool("FRT_TOUCH", true);
+		n_pending_keys_ = 0;
+		memset(key_unicode_, 0, sizeof(key_unicode_));
+		js_backend_ = parse_joystick_backend();
 		memset(js_, 0, sizeof(js_));
+		memset(gc_, 0, sizeof(gc_));
+		const float deadzone = parse_env_float("FRT_JOYSTICK_DEADZONE", 0.0f, 0.0f, 0.99f);
+		const float epsilon = parse_env_float("FRT_JOYSTICK_EPSILON", 0.0f, 0.0f, 1.0f);
+		for (int id = 0; id < MAX_JOYSTICKS; id++) {
+			axis_filter_[id].deadzone = deadzone;
+			axis_filter_[id].epsilon = epsilon;
+			axis_filter_[id].pending_mask = 0;
+		}
+		axis_events_dropped_ = 0;
 		rumble_supported_ = 0;
+		SDL_AtomicSet(&rumble_requested_, 0);
 		exit_shortcut_ = parse_exit_shortcut();
+		SDL_AtomicSet(&swap_interval_, 1);
+		current_swap_interval_ = -2; // not set yet
+		adaptive_vsync_ = parse_env_bool("FRT_VSYNC_ADAPTIVE", false);
+		idle_wait_ms_ = 0;
+		input_queue_ = 0;
+		input_thread_ = 0;
+		SDL_AtomicSet(&input_running_, 0);
+		SDL_AtomicSet(&input_queue_overflows_, 0);
+		event_time_ = 0;
+		fullscreen_mode_ = parse_fullscreen_mode();
+		fullscreen_size_.x = 0;
+		fullscreen_size_.y = 0;
+		fullscreen_refresh_rate_ = parse_env_int("FRT_FULLSCREEN_REFRESH", 0, 0, 1000);
+		n_displays_ = 0;
+		display_ = 0;
+		window_flags_ = 0;
+		draw_unfocused_ = parse_env_bool("FRT_DRAW_UNFOCUSED", true);
 		frt_resolve_symbols_sdl2();
 	}
 	void init_context_gl() {
 		context_ = SDL_GL_CreateContext(window_);
 		SDL_GL_MakeCurrent(window_, context_);
 	}
+	void init_gamecontroller() {
+		if (SDL_InitSubSystem(SDL_INIT_GAMECONTROLLER) < 0) {
+			warn("SDL_InitSubSystem failed: %s, using: joystick", SDL_GetError());
+			js_backend_ = JB_Joystick;
+			return;
+		}
+		const char *db = getenv("FRT_GAMECONTROLLERDB");
+		if (db && *db && SDL_GameControllerAddMappingsFromFile(db) < 0)
+			warn("cannot load %s: %s", db, SDL_GetError());
+	}
 	void init_window(GraphicsAPI api, int width, int height, bool resizable, bool borderless, bool always_on_top) {
 		setenv("SDL_VIDEO_RPI_OPTIONS", "gravity=center,scale=letterbox,background=1", 0);
+#ifdef SDL_HINT_TOUCH_MOUSE_EVENTS
+		if (touch_)
+			SDL_SetHint(SDL_HINT_TOUCH_MOUSE_EVENTS, "0");
+#endif
 		if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_JOYSTICK) < 0)
 			fatal("SDL_Init failed: %s.", SDL_GetError());
+		if (js_backend_ == JB_GameController)
+			init_gamecontroller();
+		/*
+		  Before 2.0.16, SDL_WaitEventTimeout wakes up every few milliseconds
+		  to poll for events, so it's no better than sleeping.
+		 */
+		SDL_version version;
+		SDL_GetVersion(&version);
+		if (SDL_VERSIONNUM(version.major, version.minor, version.patch) >= SDL_VERSIONNUM(2, 0, 16))
+			idle_wait_ms_ = parse_env_int("FRT_IDLE_WAIT", 100, 0, 1000);
+		precise_wheel_ = SDL_VERSIONNUM(version.major, version.minor, version.patch) >= SDL_VERSIONNUM(2, 0, 18);
+		init_input_thread(version);
 		int flags = SDL_WINDOW_SHOWN | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_OPENGL;
 		SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
 		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, api == API_OpenGL_ES2 ? 2 : 3);
@@ -437,69 +2029,145 @@ public:
 			flags |= SDL_WINDOW_BORDERLESS;
 		if (always_on_top)
 			flags |= SDL_WINDOW_ALWAYS_ON_TOP;
-		if (!(window_ = SDL_CreateWindow("frt2", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, flags)))
+		const int display = parse_env_int("FRT_DISPLAY", 0, 0, MAX_DISPLAYS - 1);
+		const int pos = SDL_WINDOWPOS_UNDEFINED_DISPLAY(display);
+		if (!(window_ = SDL_CreateWindow("frt2", pos, pos, width, height, flags)))
 			fatal("SDL_CreateWindow failed: %s.", SDL_GetError());
+		update_window_flags();
+		update_displays();
 	}
 	void init_gl(GraphicsAPI api, int width, int height, bool resizable, bool borderless, bool always_on_top) {
 		init_window(api, width, height, resizable, borderless, always_on_top);
 		init_context_gl();
 	}
 	void cleanup() {
+		cleanup_input_thread();
 		SDL_DestroyWindow(window_);
 		SDL_Quit();
 	}
+	/*
+	  With a separate rendering thread, the context is released by the main
+	  thread and made current in the rendering thread, so the swap interval
+	  is only applied when swapping buffers.
+	 */
 	void make_current_gl() {
 		SDL_GL_MakeCurrent(window_, context_);
 	}
 	void release_current_gl() {
-		// TODO: add release
+		SDL_GL_MakeCurrent(window_, 0);
 	}
 	void swap_buffers_gl() {
+		const uint64_t t0 = frame_trace ? FrameTrace::now() : 0;
+		const int swap_interval = SDL_AtomicGet(&swap_interval_);
+		if (swap_interval != current_swap_interval_) {
+			// adaptive vsync might not be supported
+			if (SDL_GL_SetSwapInterval(swap_interval) < 0 && swap_interval == -1)
+				SDL_GL_SetSwapInterval(1);
+			current_swap_interval_ = swap_interval;
+		}
 		SDL_GL_SwapWindow(window_);
+		if (frame_trace)
+			frame_trace->add_async(FrameTrace::SpanSwap, t0);
 	}
 	void set_use_vsync_gl(bool enable) {
-		SDL_GL_SetSwapInterval(enable ? 1 : 0);
+		SDL_AtomicSet(&swap_interval_, enable ? (adaptive_vsync_ ? -1 : 1) : 0);
 	}
-	bool is_vsync_enabled_gl() const {
-		return SDL_GL_GetSwapInterval() != 0;
+	bool is_vsync_enabled_gl() {
+		return SDL_AtomicGet(&swap_interval_) != 0;
 	}
+	/*
+	  Blocks until an event arrives or FRT_IDLE_WAIT milliseconds (default:
+	  100, 0: disabled) expire, leaving the event in the queue for
+	  dispatch_events. Main thread only.
+	 */
+	void wait_events() {
+		if (idle_wait_ms_)
+			SDL_WaitEventTimeout(0, idle_wait_ms_);
+	}
+	void dispatch_event(const SDL_Event &ev) {
+		switch (ev.type) {
+		case SDL_WINDOWEVENT:
+			window_event(ev.window);
+			break;
+#if SDL_VERSION_ATLEAST(2, 0, 9)
+		case SDL_DISPLAYEVENT:
+			update_displays();
+			break;
+#endif
+		case SDL_TEXTINPUT:
+			text_event(ev.text);
+			break;
+		case SDL_KEYUP:
+		case SDL_KEYDOWN:
+			key_event(ev.key);
+			break;
+		case SDL_MOUSEMOTION:
+		case SDL_MOUSEWHEEL:
+		case SDL_MOUSEBUTTONUP:
+		case SDL_MOUSEBUTTONDOWN:
+			mouse_event(ev);
+			break;
+		case SDL_FINGERDOWN:
+		case SDL_FINGERUP:
+		case SDL_FINGERMOTION:
+			if (touch_)
+				touch_event(ev.tfinger);
+			break;
+		case SDL_JOYAXISMOTION:
+		case SDL_JOYHATMOTION:
+		case SDL_JOYBUTTONDOWN:
+		case SDL_JOYBUTTONUP:
+		case SDL_JOYDEVICEADDED:
+		case SDL_JOYDEVICEREMOVED:
+		case SDL_CONTROLLERAXISMOTION:
+		case SDL_CONTROLLERBUTTONDOWN:
+		case SDL_CONTROLLERBUTTONUP:
+			js_event(ev);
+			break;
+		case SDL_QUIT:
+			handler_->handle_quit_event();
+			break;
+		}
+	}
+	void drain_input_queue() {
+		TimedEvent tev;
+		while (input_queue_->pop(tev)) {
+			event_time_ = tev.time;
+			dispatch_event(tev.ev);
+		}
+		event_time_ = 0;
+		if (SDL_AtomicSet(&input_queue_overflows_, 0))
+			warn("input queue full, events lost");
+	}
+	/*
+	  Video input events are queued by the watch only when pumped, so pump
+	  them before draining the queue, and drain it again after polling
+	  (which pumps too), not to leave them for the next frame.
+	 */
 	void dispatch_events() {
-		SDL_Event ev;
-		while (SDL_PollEvent(&ev)) {
-			switch (ev.type) {
-			case SDL_WINDOWEVENT:
-				if (ev.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
-					resize_event(ev);
-				break;
-			case SDL_TEXTINPUT:
-				text_event(ev.text);
-				break;
-			case SDL_KEYUP:
-			case SDL_KEYDOWN:
-				key_event(ev.key);
-				break;
-			case SDL_MOUSEMOTION:
-			case SDL_MOUSEWHEEL:
-			case SDL_MOUSEBUTTONUP:
-			case SDL_MOUSEBUTTONDOWN:
-				mouse_event(ev);
-				break;
-			case SDL_JOYAXISMOTION:
-			case SDL_JOYHATMOTION:
-			case SDL_JOYBUTTONDOWN:
-			case SDL_JOYBUTTONUP:
-			case SDL_JOYDEVICEADDED:
-			case SDL_JOYDEVICEREMOVED:
-				js_event(ev);
-				break;
-			case SDL_QUIT:
-				handler_->handle_quit_event();
-				break;
-			}
+		if (input_queue_) {
+			SDL_PumpEvents();
+			drain_input_queue();
 		}
+		SDL_Event ev;
+		while (SDL_PollEvent(&ev))
+			if (!input_queue_ || !is_input_event(ev.type))
+				dispatch_event(ev);
+		if (input_queue_)
+			drain_input_queue();
+		flush_mouse_motion();
+		flush_mouse_wheel();
+		flush_pending_keys(n_pending_keys_);
+		flush_axis_events();
 		vibra_events();
 		handler_->handle_flush_events();
 	}
+	// of the event being dispatched, -1 if unknown
+	int get_event_age_usec() const {
+		if (!event_time_)
+			return -1;
+		return (int)((SDL_GetPerformanceCounter() - event_time_) * 1000000 / SDL_GetPerformanceFrequency());
+	}
 	const InputModifierState *get_modifier_state() const {
 		return &st_;
 	}
@@ -532,56 +2200,103 @@ public:
 		SDL_GetWindowSize(window_, &size.x, &size.y);
 		return size;
 	}
+	ivec2 get_drawable_size() const {
+		ivec2 size;
+		SDL_GL_GetDrawableSize(window_, &size.x, &size.y);
+		return size;
+	}
+	int get_fullscreen_mode_count(int screen) const {
+		return SDL_GetNumDisplayModes(to_display(screen));
+	}
+	// sorted by size, then by refresh rate, largest first
+	bool get_fullscreen_mode(int screen, int index, ivec2 *size, int *refresh_rate) const {
+		SDL_DisplayMode mode;
+		if (SDL_GetDisplayMode(to_display(screen), index, &mode))
+			return false;
+		size->x = mode.w;
+		size->y = mode.h;
+		*refresh_rate = mode.refresh_rate;
+		return true;
+	}
+	// applied by set_fullscreen in exclusive fullscreen mode
+	void set_fullscreen_size(ivec2 size) {
+		fullscreen_size_ = size;
+	}
 	void set_fullscreen(bool enable) {
-		SDL_SetWindowFullscreen(window_, enable ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0); // TODO: hint
+		Uint32 flags = 0;
+		if (enable && fullscreen_mode_ == FM_Exclusive && apply_fullscreen_mode())
+			flags = SDL_WINDOW_FULLSCREEN;
+		else if (enable)
+			flags = SDL_WINDOW_FULLSCREEN_DESKTOP;
+		if (SDL_SetWindowFullscreen(window_, flags) < 0)
+			warn("SDL_SetWindowFullscreen failed: %s.", SDL_GetError());
+		update_window_flags();
+		update_displays();
 	}
+	// desktop or exclusive
 	bool is_fullscreen() const {
-		return SDL_GetWindowFlags(window_) & SDL_WINDOW_FULLSCREEN_DESKTOP;
+		return window_flags_ & SDL_WINDOW_FULLSCREEN;
 	}
 	void set_always_on_top(bool enable) {
 		// NOT IMPLEMENTED
 	}
 	bool is_always_on_top() const {
-		return SDL_GetWindowFlags(window_) & SDL_WINDOW_ALWAYS_ON_TOP;
+		return window_flags_ & SDL_WINDOW_ALWAYS_ON_TOP;
 	}
 	void set_resizable(bool enable) {
 		SDL_SetWindowResizable(window_, enable ? SDL_TRUE : SDL_FALSE);
+		update_window_flags();
 	}
 	bool is_resizable() const {
-		return SDL_GetWindowFlags(window_) & SDL_WINDOW_RESIZABLE;
+		return window_flags_ & SDL_WINDOW_RESIZABLE;
 	}
 	void set_maximized(bool enable) {
 		if (enable)
 			SDL_MaximizeWindow(window_);
 		else
 			SDL_RestoreWindow(window_);
+		update_window_flags();
 	}
 	bool is_maximized() const {
-		return SDL_GetWindowFlags(window_) & SDL_WINDOW_MAXIMIZED;
+		return window_flags_ & SDL_WINDOW_MAXIMIZED;
 	}
 	void set_minimized(bool enable) {
 		if (enable)
 			SDL_MinimizeWindow(window_);
 		else
 			SDL_RestoreWindow(window_);
+		update_window_flags();
 	}
 	bool is_minimized() const {
-		return SDL_GetWindowFlags(window_) & SDL_WINDOW_MINIMIZED;
+		return window_flags_ & SDL_WINDOW_MINIMIZED;
+	}
+	bool is_focused() const {
+		return window_flags_ & SDL_WINDOW_INPUT_FOCUS;
 	}
 	bool can_draw() const {
-		return !is_minimized();
+		if (window_flags_ & (SDL_WINDOW_MINIMIZED | SDL_WINDOW_HIDDEN))
+			return false;
+		return draw_unfocused_ || is_focused();
 	}
 	void set_mouse_mode(MouseMode mouse_mode) {
+		/*
+		  Relative mouse mode reports motion past the screen edges. If not
+		  supported, the mouse is just captured.
+		 */
 		switch (mouse_mode) {
 		case MouseVisible:
+			SDL_SetRelativeMouseMode(SDL_FALSE);
 			SDL_CaptureMouse(SDL_FALSE);
 			SDL_ShowCursor(1);
 			break;
 		case MouseHidden:
+			SDL_SetRelativeMouseMode(SDL_FALSE);
 			SDL_CaptureMouse(SDL_FALSE);
 			SDL_ShowCursor(0);
 			break;
 		case MouseCaptured:
+			if (SDL_SetRelativeMouseMode(SDL_TRUE) == 0)
+				break;
 			SDL_ShowCursor(0);
 			SDL_CaptureMouse(SDL_TRUE);
 			break;
@@ -591,26 +2306,70 @@ public:
 	MouseMode get_mouse_mode() const {
 		return mouse_mode_;
 	}
-	ivec2 get_screen_size() const {
-		ivec2 size = { 1280, 720 };
-		SDL_DisplayMode mode;
-		if (!SDL_GetCurrentDisplayMode(0, &mode)) {
-			size.x = mode.w;
-			size.y = mode.h;
-		}
-		return size;
+	int get_display() const {
+		return display_;
 	}
-	float get_screen_refresh_rate() const {
-		SDL_DisplayMode mode;
-		if (SDL_GetCurrentDisplayMode(0, &mode))
-			return 60.0f;
-		return (float)mode.refresh_rate;
-	}
-	int get_screen_dpi() const {
-		float dpi;
-		if (!SDL_GetDisplayDPI(0, &dpi, 0, 0))
-			return (int)dpi;
-		return 72;
+	int get_screen_count() const {
+		return n_displays_;
+	}
+	// centered, keeping fullscreen
+	void set_screen(int screen) {
+		if (screen < 0 || screen >= n_displays_ || screen == display_)
+			return;
+		const bool fullscreen = is_fullscreen();
+		if (fullscreen)
+			SDL_SetWindowFullscreen(window_, 0);
+		const int pos = SDL_WINDOWPOS_CENTERED_DISPLAY(screen);
+		SDL_SetWindowPosition(window_, pos, pos);
+		update_window_display();
+		if (fullscreen)
+			set_fullscreen(true);
+	}
+	ivec2 get_screen_pos(int screen) const {
+		return get_display_info(screen).pos;
+	}
+	ivec2 get_screen_size(int screen) const {
+		return get_display_info(screen).size;
+	}
+	float get_screen_refresh_rate(int screen) const {
+		return get_display_info(screen).refresh_rate;
+	}
+	int get_screen_dpi(int screen) const {
+		return get_display_info(screen).dpi;
+	}
+	void set_js_deadzone(int id, float deadzone) {
+		if (id >= 0 && id < MAX_JOYSTICKS && deadzone >= 0.0f && deadzone < 1.0f)
+			axis_filter_[id].deadzone = deadzone;
+	}
+	float get_js_deadzone(int id) const {
+		return id >= 0 && id < MAX_JOYSTICKS ? axis_filter_[id].deadzone : 0.0f;
+	}
+	void set_js_epsilon(int id, float epsilon) {
+		if (id >= 0 && id < MAX_JOYSTICKS && epsilon >= 0.0f)
+			axis_filter_[id].epsilon = epsilon;
+	}
+	float get_js_epsilon(int id) const {
+		return id >= 0 && id < MAX_JOYSTICKS ? axis_filter_[id].epsilon : 0.0f;
+	}
+	int get_js_axis_events_dropped() const {
+		return axis_events_dropped_;
+	}
+	// any thread
+	void request_js_vibra(int id) {
+		if (id < 0 || id >= MAX_JOYSTICKS)
+			return;
+		int mask;
+		do {
+			mask = SDL_AtomicGet(&rumble_requested_);
+		} while (!SDL_AtomicCAS(&rumble_requested_, mask, mask | (1 << id)));
+	}
+	bool js_trigger_vibra(int id, float left, float right, float duration) {
+		if (id < 0 || id >= MAX_JOYSTICKS || !js_[id] || !SDL_JoystickRumbleTriggers)
+			return false;
+		int low = (int)(left * 0xffff);
+		int high = (int)(right * 0xffff);
+		int ms = (int)(duration * 1000);
+		return SDL_JoystickRumbleTriggers(js_[id], low, high, ms) == 0;
 	}
 	void js_vibra(int id, float x, float y, float duration, uint64_t timestamp) {
 		int low = (int)(x * 0xffff);
@@ -28,6 +28,10 @@ int map_mouse_os_button(int os_button) {
 		return BUTTON_WHEEL_UP;
 	case WheelDown:
 		return BUTTON_WHEEL_DOWN;
+	case WheelLeft:
+		return BUTTON_WHEEL_LEFT;
+	case WheelRight:
+		return BUTTON_WHEEL_RIGHT;
 	default:
 		fatal("unexpected mouse button: %d", os_button);
 	}
@@ -73,10 +77,70 @@ int map_hat_os_mask(int os_mask) {
 	return mask;
 }
 
+// -1: no equivalent
+int map_pad_sdl2_button(int sdl2_button) {
+	switch (sdl2_button) {
+	case SDL_CONTROLLER_BUTTON_A:
+		return JOY_XBOX_A;
+	case SDL_CONTROLLER_BUTTON_B:
+		return JOY_XBOX_B;
+	case SDL_CONTROLLER_BUTTON_X:
+		return JOY_XBOX_X;
+	case SDL_CONTROLLER_BUTTON_Y:
+		return JOY_XBOX_Y;
+	case SDL_CONTROLLER_BUTTON_BACK:
+		return JOY_SELECT;
+	case SDL_CONTROLLER_BUTTON_GUIDE:
+		return JOY_GUIDE;
+	case SDL_CONTROLLER_BUTTON_START:
+		return JOY_START;
+	case SDL_CONTROLLER_BUTTON_LEFTSTICK:
+		return JOY_L3;
+	case SDL_CONTROLLER_BUTTON_RIGHTSTICK:
+		return JOY_R3;
+	case SDL_CONTROLLER_BUTTON_LEFTSHOULDER:
+		return JOY_L;
+	case SDL_CONTROLLER_BUTTON_RIGHTSHOULDER:
+		return JOY_R;
+	case SDL_CONTROLLER_BUTTON_DPAD_UP:
+		return JOY_DPAD_UP;
+	case SDL_CONTROLLER_BUTTON_DPAD_DOWN:
+		return JOY_DPAD_DOWN;
+	case SDL_CONTROLLER_BUTTON_DPAD_LEFT:
+		return JOY_DPAD_LEFT;
+	case SDL_CONTROLLER_BUTTON_DPAD_RIGHT:
+		return JOY_DPAD_RIGHT;
+	default:
+		return -1;
+	}
+}
+
+// -1: no equivalent
+int map_pad_sdl2_axis(int sdl2_axis) {
+	switch (sdl2_axis) {
+	case SDL_CONTROLLER_AXIS_LEFTX:
+		return JOY_ANALOG_LX;
+	case SDL_CONTROLLER_AXIS_LEFTY:
+		return JOY_ANALOG_LY;
+	case SDL_CONTROLLER_AXIS_RIGHTX:
+		return JOY_ANALOG_RX;
+	case SDL_CONTROLLER_AXIS_RIGHTY:
+		return JOY_ANALOG_RY;
+	case SDL_CONTROLLER_AXIS_TRIGGERLEFT:
+		return JOY_ANALOG_L2;
+	case SDL_CONTROLLER_AXIS_TRIGGERRIGHT:
+		return JOY_ANALOG_R2;
+	default:
+		return -1;
+	}
+}
+
 struct KeyMap {
 	int sdl2_code;
 	int gd_code;
-} keymap[] = {
+};
+
+constexpr KeyMap keymap[] = {
 	{ SDLK_SPACE, ' ' },
 	{ SDLK_a, 'A' },
 	{ SDLK_b, 'B' },
@@ -114,6 +178,18 @@ struct KeyMap {
 	{ SDLK_7, '7' },
 	{ SDLK_8, '8' },
 	{ SDLK_9, '9' },
+	{ SDLK_MINUS, '-' },
+	{ SDLK_EQUALS, '=' },
+	{ SDLK_LEFTBRACKET, '[' },
+	{ SDLK_RIGHTBRACKET, ']' },
+	{ SDLK_BACKSLASH, '\\' },
+	{ SDLK_SEMICOLON, ';' },
+	{ SDLK_QUOTE, '\'' },
+	{ SDLK_BACKQUOTE, '`' },
+	{ SDLK_COMMA, ',' },
+	{ SDLK_PERIOD, '.' },
+	{ SDLK_SLASH, '/' },
+	{ SDLK_LESS, '<' },
 	{ SDLK_F1, KEY_F1 },
 	{ SDLK_F2, KEY_F2 },
 	{ SDLK_F3, KEY_F3 },
@@ -140,6 +216,12 @@ struct KeyMap {
 	{ SDLK_PAGEDOWN, KEY_PAGEDOWN },
 	{ SDLK_RETURN, KEY_ENTER },
 	{ SDLK_ESCAPE, KEY_ESCAPE },
+	{ SDLK_CAPSLOCK, KEY_CAPSLOCK },
+	{ SDLK_NUMLOCKCLEAR, KEY_NUMLOCK },
+	{ SDLK_SCROLLLOCK, KEY_SCROLLLOCK },
+	{ SDLK_PRINTSCREEN, KEY_PRINT },
+	{ SDLK_PAUSE, KEY_PAUSE },
+	{ SDLK_APPLICATION, KEY_MENU },
 	{ SDLK_LCTRL, KEY_CONTROL },
 	{ SDLK_RCTRL, KEY_CONTROL },
 	{ SDLK_LALT, KEY_ALT },
@@ -167,12 +249,169 @@ struct KeyMap {
 	{ 0, 0 },
 };
 
-int map_key_sdl2_code(int sdl2_code) {
-	for (int i = 0; keymap[i].sdl2_code; i++) {
-		if (keymap[i].sdl2_code == sdl2_code)
-			return keymap[i].gd_code;
+const int N_OF_KEYS = sizeof(keymap) / sizeof(keymap[0]) - 1;
+
+/*
+  SDL2 keycodes are either ASCII characters or scancodes with
+  SDLK_SCANCODE_MASK set, and Godot keycodes are either ASCII characters or
+  special keys with SPKEY set, so both directions can be looked up in dense
+  tables. They hold keymap indices plus one (0: not mapped) and are built at
+  compile time. When more SDL2 keys map to the same Godot key, the first one
+  is used for the reverse mapping.
+ */
+class KeyIndex {
+private:
+	static const int N_OF_CHARS = 0x80;
+	static const int N_OF_SPECIAL_KEYS = 0x100;
+	static_assert(N_OF_KEYS < 0xff, "keymap indices must fit in a byte");
+	uint8_t sdl2_char_[N_OF_CHARS];
+	uint8_t sdl2_scancode_[SDL_NUM_SCANCODES];
+	uint8_t gd_char_[N_OF_CHARS];
+	uint8_t gd_special_[N_OF_SPECIAL_KEYS];
+	static constexpr bool is_sdl2_char(int code) {
+		return code >= 0 && code < N_OF_CHARS;
+	}
+	static constexpr bool is_sdl2_scancode(int code) {
+		return (code & SDLK_SCANCODE_MASK) && (code & ~SDLK_SCANCODE_MASK) < SDL_NUM_SCANCODES;
+	}
+	static constexpr bool is_gd_char(int code) {
+		return code >= 0 && code < N_OF_CHARS;
+	}
+	static constexpr bool is_gd_special(int code) {
+		return (code & SPKEY) && (code & ~SPKEY) < N_OF_SPECIAL_KEYS;
+	}
+public:
+	constexpr KeyIndex() : sdl2_char_(), sdl2_scancode_(), gd_char_(), gd_special_() {
+		for (int i = N_OF_KEYS - 1; i >= 0; i--) {
+			const int sdl2_code = keymap[i].sdl2_code;
+			const int gd_code = keymap[i].gd_code;
+			if (is_sdl2_char(sdl2_code))
+				sdl2_char_[sdl2_code] = i + 1;
+			else if (is_sdl2_scancode(sdl2_code))
+				sdl2_scancode_[sdl2_code & ~SDLK_SCANCODE_MASK] = i + 1;
+			if (is_gd_char(gd_code))
+				gd_char_[gd_code] = i + 1;
+			else if (is_gd_special(gd_code))
+				gd_special_[gd_code & ~SPKEY] = i + 1;
+		}
+	}
+	constexpr int find_sdl2_code(int sdl2_code) const {
+		if (is_sdl2_char(sdl2_code))
+			return sdl2_char_[sdl2_code] - 1;
+		else if (is_sdl2_scancode(sdl2_code))
+			return sdl2_scancode_[sdl2_code & ~SDLK_SCANCODE_MASK] - 1;
+		else
+			return -1;
+	}
+	constexpr int find_gd_code(int gd_code) const {
+		if (is_gd_char(gd_code))
+			return gd_char_[gd_code] - 1;
+		else if (is_gd_special(gd_code))
+			return gd_special_[gd_code & ~SPKEY] - 1;
+		else
+			return -1;
+	}
+};
+
+constexpr KeyIndex key_index;
+
+constexpr int map_key_sdl2_code(int sdl2_code) {
+	const int i = key_index.find_sdl2_code(sdl2_code);
+	return i < 0 ? 0 : keymap[i].gd_code;
+}
+
+constexpr int map_key_gd_code(int gd_code) {
+	const int i = key_index.find_gd_code(gd_code);
+	return i < 0 ? 0 : keymap[i].sdl2_code;
+}
+
+constexpr bool keymap_round_trips() {
+	for (int i = 0; i < N_OF_KEYS; i++) {
+		const int gd_code = keymap[i].gd_code;
+		if (!gd_code || map_key_sdl2_code(keymap[i].sdl2_code) != gd_code)
+			return false;
+		if (map_key_sdl2_code(map_key_gd_code(gd_code)) != gd_code)
+			return false;
+	}
+	return true;
+}
+
+static_assert(keymap_round_trips(), "every keymap entry must be reachable in both directions");
+
+// keycode of a key with a US layout
+constexpr int us_keycode(int scancode) {
+	if (scancode >= SDL_SCANCODE_A && scancode <= SDL_SCANCODE_Z)
+		return SDLK_a + (scancode - SDL_SCANCODE_A);
+	if (scancode >= SDL_SCANCODE_1 && scancode <= SDL_SCANCODE_9)
+		return SDLK_1 + (scancode - SDL_SCANCODE_1);
+	switch (scancode) {
+	case SDL_SCANCODE_0:
+		return SDLK_0;
+	case SDL_SCANCODE_RETURN:
+		return SDLK_RETURN;
+	case SDL_SCANCODE_ESCAPE:
+		return SDLK_ESCAPE;
+	case SDL_SCANCODE_BACKSPACE:
+		return SDLK_BACKSPACE;
+	case SDL_SCANCODE_TAB:
+		return SDLK_TAB;
+	case SDL_SCANCODE_SPACE:
+		return SDLK_SPACE;
+	case SDL_SCANCODE_MINUS:
+		return SDLK_MINUS;
+	case SDL_SCANCODE_EQUALS:
+		return SDLK_EQUALS;
+	case SDL_SCANCODE_LEFTBRACKET:
+		return SDLK_LEFTBRACKET;
+	case SDL_SCANCODE_RIGHTBRACKET:
+		return SDLK_RIGHTBRACKET;
+	case SDL_SCANCODE_BACKSLASH:
+	case SDL_SCANCODE_NONUSHASH:
+		return SDLK_BACKSLASH;
+	case SDL_SCANCODE_SEMICOLON:
+		return SDLK_SEMICOLON;
+	case SDL_SCANCODE_APOSTROPHE:
+		return SDLK_QUOTE;
+	case SDL_SCANCODE_GRAVE:
+		return SDLK_BACKQUOTE;
+	case SDL_SCANCODE_COMMA:
+		return SDLK_COMMA;
+	case SDL_SCANCODE_PERIOD:
+		return SDLK_PERIOD;
+	case SDL_SCANCODE_SLASH:
+		return SDLK_SLASH;
+	case SDL_SCANCODE_NONUSBACKSLASH:
+		return SDLK_LESS;
+	case SDL_SCANCODE_DELETE:
+		return SDLK_DELETE;
+	default:
+		return SDL_SCANCODE_TO_KEYCODE(scancode);
 	}
-	return 0;
 }
 
+/*
+  Physical keys: SDL2 scancodes are mapped to the Godot key they would
+  produce with a US layout, in a dense table built at compile time.
+ */
+class ScancodeIndex {
+private:
+	int gd_code_[SDL_NUM_SCANCODES];
+public:
+	constexpr ScancodeIndex() : gd_code_() {
+		for (int i = 0; i < SDL_NUM_SCANCODES; i++)
+			gd_code_[i] = map_key_sdl2_code(us_keycode(i));
+	}
+	constexpr int find(int scancode) const {
+		return scancode >= 0 && scancode < SDL_NUM_SCANCODES ? gd_code_[scancode] : 0;
+	}
+};
+
+constexpr ScancodeIndex scancode_index;
+
+constexpr int map_key_sdl2_scancode(int sdl2_scancode) {
+	return scancode_index.find(sdl2_scancode);
+}
+
+static_assert(map_key_sdl2_scancode(SDL_SCANCODE_COMMA) == ',', "punctuation must have a physical key");
+
 } // namespace frt